@@ -5,6 +5,11 @@
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <cstdint>
+#include <bit>
+#include <iterator>
+#include <thread>
+#include <exception>
 
 template <size_t N>
 class Mask {
@@ -72,4 +77,393 @@ public:
         }
         return result;
     }
+
+    // То же, что slice_and_transform, но по частям в нескольких потоках.
+    // Число выбранных элементов перед любой позицией k известно заранее:
+    // (k / N) * ones + prefix[k % N], поэтому результат создаётся сразу
+    // нужного размера, а каждый поток пишет в свой участок без синхронизации
+    // и с сохранением порядка.
+    template <typename Container, typename Func>
+    std::vector<typename Container::value_type> parallel_slice_and_transform(
+            const Container& container, Func&& f,
+            size_t threads = std::max(1u, std::thread::hardware_concurrency())) const {
+        using Value = typename Container::value_type;
+        constexpr size_t min_items_per_thread = 16384;
+        size_t n = std::size(container);
+        size_t chunks = std::min(threads, n / min_items_per_thread);
+        // Потоки пишут в соседние элементы результата, поэтому элементы должны
+        // быть отдельными объектами: std::vector<bool> хранит их битами в общих словах
+        if constexpr (!std::random_access_iterator<decltype(std::begin(container))>
+                      || !std::is_default_constructible_v<Value>
+                      || !std::is_same_v<decltype(*std::declval<std::vector<Value>&>().begin()), Value&>) {
+            return slice_and_transform(container, std::forward<Func>(f));
+        } else {
+            if (chunks <= 1) {
+                return slice_and_transform(container, std::forward<Func>(f));
+            }
+            std::array<size_t, N + 1> prefix{};
+            for (size_t i = 0; i < N; ++i) {
+                prefix[i + 1] = prefix[i] + static_cast<size_t>(data_[i]);
+            }
+            auto selected_before = [&](size_t k) { return k / N * prefix[N] + prefix[k % N]; };
+
+            std::vector<Value> result(selected_before(n));
+            std::vector<std::exception_ptr> errors(chunks);
+            auto run = [&](size_t c) {
+                try {
+                    size_t begin = n * c / chunks;
+                    size_t end = n * (c + 1) / chunks;
+                    auto out = result.begin() + static_cast<std::ptrdiff_t>(selected_before(begin));
+                    auto it = std::begin(container) + static_cast<std::ptrdiff_t>(begin);
+                    size_t mask_idx = begin % N;
+                    for (size_t i = begin; i < end; ++i, ++it) {
+                        if (data_[mask_idx] == 1) {
+                            *out++ = std::invoke(f, *it);
+                        }
+                        if (++mask_idx == N) {
+                            mask_idx = 0;
+                        }
+                    }
+                } catch (...) {
+                    errors[c] = std::current_exception();
+                }
+            };
+            std::vector<std::thread> workers;
+            workers.reserve(chunks - 1);
+            for (size_t c = 1; c < chunks; ++c) {
+                workers.emplace_back(run, c);
+            }
+            run(0);
+            for (auto& w : workers) {
+                w.join();
+            }
+            for (auto& e : errors) {
+                if (e) {
+                    std::rethrow_exception(e);
+                }
+            }
+            return result;
+        }
+    }
+};
+
+// Маска строк и маска столбцов для плотной матрицы, хранящейся по строкам.
+// Как и Mask, обе маски повторяются с периодом R и C. Выбранные строки и
+// непрерывные отрезки выбранных столбцов вычисляются один раз на вызов;
+// затем выбранные строки обходятся по порядку, и отрезки каждой строки
+// копируются целиком.
+//
+// Плитки здесь не нужны. Каждый элемент источника читается не больше одного
+// раза, а источник и результат проходятся в порядке возрастания адресов.
+// Блокировка окупается, только когда загруженная строка кеша используется
+// повторно, как при транспонировании; здесь повторов нет. При редких
+// столбцах обход плитками загружал бы те же строки кеша, только не подряд,
+// и аппаратная предвыборка работала бы хуже.
+template <size_t R, size_t C>
+class Mask2D {
+private:
+    Mask<R> rows_;
+    Mask<C> cols_;
+
+    struct Run {
+        size_t begin;
+        size_t end;
+        size_t offset;
+    };
+
+    static void check_shape(size_t size, size_t cols) {
+        if (cols == 0 || size % cols != 0) {
+            throw std::invalid_argument("Matrix size is not a multiple of the row width");
+        }
+    }
+
+    std::vector<size_t> selected_rows(size_t rows) const {
+        std::vector<size_t> result;
+        for (size_t r = 0; r < rows; ++r) {
+            if (rows_.at(r % R) == 1) {
+                result.push_back(r);
+            }
+        }
+        return result;
+    }
+
+    std::vector<Run> column_runs(size_t cols) const {
+        std::vector<Run> runs;
+        size_t offset = 0;
+        for (size_t c = 0; c < cols; ++c) {
+            if (cols_.at(c % C) != 1) {
+                continue;
+            }
+            if (!runs.empty() && runs.back().end == c) {
+                ++runs.back().end;
+            } else {
+                runs.push_back({c, c + 1, offset});
+            }
+            ++offset;
+        }
+        return runs;
+    }
+
+    template <typename Visit>
+    static void for_each_run(const std::vector<size_t>& rows, const std::vector<Run>& runs, Visit&& visit) {
+        for (size_t i = 0; i < rows.size(); ++i) {
+            for (const Run& run : runs) {
+                visit(i, rows[i], run);
+            }
+        }
+    }
+
+public:
+    Mask2D(const Mask<R>& rows, const Mask<C>& cols) : rows_(rows), cols_(cols) {}
+
+    size_t extracted_width(size_t cols) const {
+        size_t width = 0;
+        for (size_t c = 0; c < cols; ++c) {
+            width += cols_.at(c % C) == 1;
+        }
+        return width;
+    }
+
+    // Выбранная подматрица по строкам, ширина - extracted_width(cols)
+    template <typename Container>
+    std::vector<typename Container::value_type> extract(const Container& matrix, size_t cols) const {
+        check_shape(std::size(matrix), cols);
+        auto rows = selected_rows(std::size(matrix) / cols);
+        auto runs = column_runs(cols);
+        size_t width = runs.empty() ? 0 : runs.back().offset + (runs.back().end - runs.back().begin);
+        std::vector<typename Container::value_type> result(rows.size() * width);
+        const auto* in = std::data(matrix);
+        auto* out = result.data();
+        for_each_run(rows, runs, [&](size_t i, size_t row, const Run& run) {
+            std::copy(in + row * cols + run.begin, in + row * cols + run.end, out + i * width + run.offset);
+        });
+        return result;
+    }
+
+    template <typename Container, typename Func>
+    void transform(Container& matrix, size_t cols, Func&& f) const {
+        check_shape(std::size(matrix), cols);
+        auto rows = selected_rows(std::size(matrix) / cols);
+        auto runs = column_runs(cols);
+        auto* data = std::data(matrix);
+        for_each_run(rows, runs, [&](size_t, size_t row, const Run& run) {
+            for (auto* it = data + row * cols + run.begin; it != data + row * cols + run.end; ++it) {
+                *it = std::invoke(f, *it);
+            }
+        });
+    }
 };
+
+// Произвольная маска размера rows x cols: по биту на элемент, строки
+// выровнены по 64-битным словам. Обход идёт по строкам подряд, как и сама
+// матрица, поэтому плитки не нужны; пустые слова пропускаются целиком, а
+// полностью выбранные копируются одним отрезком.
+class BitMatrixMask {
+private:
+    size_t rows_;
+    size_t cols_;
+    size_t words_per_row_;
+    std::vector<uint64_t> bits_;
+
+    void check_shape(size_t size) const {
+        if (size != rows_ * cols_) {
+            throw std::invalid_argument("Matrix size does not match the mask");
+        }
+    }
+
+    template <typename Visit>
+    void for_each_selected(Visit&& visit) const {
+        for (size_t r = 0; r < rows_; ++r) {
+            const uint64_t* row = bits_.data() + r * words_per_row_;
+            for (size_t w = 0; w < words_per_row_; ++w) {
+                uint64_t word = row[w];
+                size_t base = r * cols_ + w * 64;
+                if (word == ~uint64_t(0)) {
+                    visit(base, base + 64);
+                    continue;
+                }
+                while (word != 0) {
+                    size_t bit = static_cast<size_t>(std::countr_zero(word));
+                    size_t run = static_cast<size_t>(std::countr_one(word >> bit));
+                    visit(base + bit, base + bit + run);
+                    word = run + bit >= 64 ? 0 : word & (~uint64_t(0) << (bit + run));
+                }
+            }
+        }
+    }
+
+public:
+    BitMatrixMask(size_t rows, size_t cols)
+        : rows_(rows), cols_(cols), words_per_row_((cols + 63) / 64), bits_(rows * words_per_row_, 0) {}
+
+    template <size_t R, size_t C>
+    BitMatrixMask(const Mask<R>& row_mask, const Mask<C>& col_mask, size_t rows, size_t cols) : BitMatrixMask(rows, cols) {
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t c = 0; c < cols; ++c) {
+                set(r, c, row_mask.at(r % R) == 1 && col_mask.at(c % C) == 1);
+            }
+        }
+    }
+
+    size_t rows() const { return rows_; }
+    size_t cols() const { return cols_; }
+
+    void set(size_t r, size_t c, bool value = true) {
+        if (r >= rows_ || c >= cols_) {
+            throw std::out_of_range("Index out of range in BitMatrixMask");
+        }
+        uint64_t& word = bits_[r * words_per_row_ + c / 64];
+        uint64_t bit = uint64_t(1) << (c % 64);
+        word = value ? word | bit : word & ~bit;
+    }
+
+    bool test(size_t r, size_t c) const {
+        if (r >= rows_ || c >= cols_) {
+            throw std::out_of_range("Index out of range in BitMatrixMask");
+        }
+        return (bits_[r * words_per_row_ + c / 64] >> (c % 64)) & 1;
+    }
+
+    size_t count() const {
+        size_t total = 0;
+        for (uint64_t word : bits_) {
+            total += static_cast<size_t>(std::popcount(word));
+        }
+        return total;
+    }
+
+    // Выбранные элементы в построчном порядке
+    template <typename Container>
+    std::vector<typename Container::value_type> extract(const Container& matrix) const {
+        check_shape(std::size(matrix));
+        std::vector<typename Container::value_type> result(count());
+        const auto* in = std::data(matrix);
+        auto* out = result.data();
+        for_each_selected([&](size_t begin, size_t end) {
+            out = std::copy(in + begin, in + end, out);
+        });
+        return result;
+    }
+
+    template <typename Container, typename Func>
+    void transform(Container& matrix, Func&& f) const {
+        check_shape(std::size(matrix));
+        auto* data = std::data(matrix);
+        for_each_selected([&](size_t begin, size_t end) {
+            for (auto* it = data + begin; it != data + end; ++it) {
+                *it = std::invoke(f, *it);
+            }
+        });
+    }
+};
+
+#ifdef MASK_SELFTEST
+// Проверка масок на сравнении с поэлементным обходом:
+// g++ -std=c++20 -DMASK_SELFTEST Mask.cpp && ./a.out
+#include <random>
+
+namespace {
+
+template <size_t R, size_t C>
+std::vector<int> naive_extract(const Mask<R>& rows, const Mask<C>& cols, const std::vector<int>& matrix, size_t width) {
+    std::vector<int> result;
+    for (size_t r = 0; r < matrix.size() / width; ++r) {
+        for (size_t c = 0; c < width; ++c) {
+            if (rows.at(r % R) == 1 && cols.at(c % C) == 1) {
+                result.push_back(matrix[r * width + c]);
+            }
+        }
+    }
+    return result;
+}
+
+std::vector<int> numbered(size_t n) {
+    std::vector<int> values(n);
+    for (size_t i = 0; i < n; ++i) {
+        values[i] = static_cast<int>(i);
+    }
+    return values;
+}
+
+template <size_t R, size_t C>
+bool check_mask2d(const Mask<R>& rows, const Mask<C>& cols, size_t height, size_t width) {
+    Mask2D<R, C> mask(rows, cols);
+    auto matrix = numbered(height * width);
+    bool ok = mask.extract(matrix, width) == naive_extract(rows, cols, matrix, width);
+
+    auto changed = matrix;
+    mask.transform(changed, width, [](int x) { return -x - 1; });
+    for (size_t r = 0; r < height; ++r) {
+        for (size_t c = 0; c < width; ++c) {
+            bool selected = rows.at(r % R) == 1 && cols.at(c % C) == 1;
+            int original = matrix[r * width + c];
+            ok = ok && changed[r * width + c] == (selected ? -original - 1 : original);
+        }
+    }
+    return ok;
+}
+
+bool check_bit_matrix(size_t height, size_t width, double density, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::bernoulli_distribution pick(density);
+    BitMatrixMask mask(height, width);
+    std::vector<int> expected;
+    auto matrix = numbered(height * width);
+    auto changed = matrix;
+    for (size_t r = 0; r < height; ++r) {
+        for (size_t c = 0; c < width; ++c) {
+            if (pick(rng)) {
+                mask.set(r, c);
+                expected.push_back(matrix[r * width + c]);
+                changed[r * width + c] = matrix[r * width + c] * 2;
+            }
+        }
+    }
+    auto transformed = matrix;
+    mask.transform(transformed, [](int x) { return x * 2; });
+    return mask.count() == expected.size() && mask.extract(matrix) == expected && transformed == changed;
+}
+
+bool check_parallel(size_t n, size_t threads) {
+    Mask<5> mask(1, 0, 1, 1, 0);
+    auto values = numbered(n);
+    auto f = [](int x) { return x * 3 + 1; };
+    return mask.parallel_slice_and_transform(values, f, threads) == mask.slice_and_transform(values, f);
+}
+
+} // namespace
+
+int main() {
+    // Размеры не кратны периодам масок и прежним размерам плиток (64 x 256)
+    bool small = check_mask2d(Mask<3>(1, 0, 1), Mask<4>(1, 1, 0, 1), 7, 10);
+    bool large = check_mask2d(Mask<3>(1, 1, 0), Mask<5>(0, 1, 0, 0, 1), 131, 301);
+    bool dense = check_mask2d(Mask<2>(1, 1), Mask<2>(1, 1), 65, 257);
+    bool empty = check_mask2d(Mask<3>(0, 0, 0), Mask<4>(1, 1, 0, 1), 7, 10)
+              && check_mask2d(Mask<3>(1, 0, 1), Mask<4>(0, 0, 0, 0), 7, 10)
+              && check_mask2d(Mask<3>(1, 0, 1), Mask<4>(1, 1, 0, 1), 0, 10);
+    std::cout << std::boolalpha;
+    std::cout << "Mask2D extract and transform match the reference: " << (small && large && dense) << std::endl;
+    std::cout << "Mask2D empty masks and empty matrix: " << empty << std::endl;
+
+    Mask<3> rowMask(1, 0, 1);
+    Mask<4> colMask(0, 1, 1, 1);
+    auto matrix = numbered(67 * 130);
+    bool fromMasks = BitMatrixMask(rowMask, colMask, 67, 130).extract(matrix)
+                  == Mask2D<3, 4>(rowMask, colMask).extract(matrix, 130);
+    bool bits = check_bit_matrix(67, 130, 0.3, 1) && check_bit_matrix(5, 128, 1.0, 2)
+             && check_bit_matrix(9, 70, 0.0, 3) && check_bit_matrix(0, 70, 0.5, 4);
+    std::cout << "BitMatrixMask matches Mask2D for row x column masks: " << fromMasks << std::endl;
+    std::cout << "BitMatrixMask extract and transform match the reference: " << bits << std::endl;
+
+    // Меньше двух частей по 16384 элемента - последовательный путь
+    bool parallel = true;
+    for (size_t n : {size_t(0), size_t(1), size_t(16383), size_t(32767), size_t(32768), size_t(49157), size_t(100003)}) {
+        for (size_t threads : {size_t(1), size_t(3), size_t(4)}) {
+            parallel = parallel && check_parallel(n, threads);
+        }
+    }
+    std::cout << "Parallel slice_and_transform keeps values and order: " << parallel << std::endl;
+
+    return small && large && dense && empty && fromMasks && bits && parallel ? 0 : 1;
+}
+#endif
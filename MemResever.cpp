@@ -1,6 +1,28 @@
 #include <type_traits> 
 #include <exception> 
 #include <string>     
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <utility>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <array>
+#include <bit>
+#include <functional>
+#include <system_error>
+#include <stdexcept>
+#include <iterator>
+#include <cerrno>
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 class NotEnoughSlotsError : public std::exception {
 private:
@@ -21,11 +43,25 @@ public:
     }
 };
 
+// Тег для включения отложенного уничтожения объектов в MemReserver
+struct DeferredDestruction {};
+inline constexpr DeferredDestruction deferred_destruction{};
+
 template <typename T, size_t N>
 class MemReserver {
+public:
+    using index_type = std::conditional_t<(N < std::numeric_limits<uint32_t>::max()), uint32_t, size_t>;
+
 private:
+    // Пока слот свободен, его память хранит ссылку на следующий свободный слот,
+    // поэтому отдельный стек свободных номеров не нужен. Ссылка - это номер
+    // слота плюс один, 0 означает конец списка: так пустой пул целиком состоит
+    // из нулей и constinit-экземпляр попадает в .bss.
     struct Slot {
-        alignas(T) char data[sizeof(T)];
+        union {
+            alignas(T) char data[sizeof(T)];
+            index_type next_free = 0;
+        };
         bool occupied = false;
 
         T* obj() { return reinterpret_cast<T*>(data); }
@@ -38,36 +74,125 @@ private:
 
         void destruct() {
             if (occupied) {
-                obj()->~T();
+                if constexpr (!std::is_trivially_destructible_v<T>) {
+                    obj()->~T();
+                }
                 occupied = false;
             }
         }
     };
 
+    static constexpr bool trivial_destruction = std::is_trivially_destructible_v<T>;
+
+    // Фоновый поток, который уничтожает удалённые объекты пачками
+    // и возвращает их слоты в список свободных.
+    struct Reclaimer {
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable returned;
+        std::vector<index_type> retired;
+        size_t pending = 0;
+        bool stopping = false;
+        std::thread worker;
+    };
+
+    // Слоты с номерами от fresh и дальше ещё ни разу не выдавались и не входят
+    // в список свободных, поэтому конструктор не обходит весь массив.
     Slot slots[N];
-    size_t free_stack[N];
-    size_t free_top = N;
+    index_type free_head = 0;
+    index_type fresh = 0;
+    size_t created = 0;
+    std::unique_ptr<Reclaimer> reclaimer;
 
-public:
-    MemReserver() {
-        for (size_t i = 0; i < N; ++i) {
-            free_stack[i] = i;
+    std::unique_lock<std::mutex> lock_free_list() {
+        if (reclaimer) {
+            return std::unique_lock<std::mutex>(reclaimer->mutex);
+        }
+        return std::unique_lock<std::mutex>();
+    }
+
+    void reclaim_loop() {
+        std::vector<index_type> batch;
+        batch.reserve(N);
+        std::unique_lock<std::mutex> lock(reclaimer->mutex);
+        while (true) {
+            reclaimer->wake.wait(lock, [this] {
+                return reclaimer->stopping || !reclaimer->retired.empty();
+            });
+            if (reclaimer->retired.empty()) {
+                break;
+            }
+            batch.swap(reclaimer->retired);
+            lock.unlock();
+            for (index_type idx : batch) {
+                slots[idx].obj()->~T();
+            }
+            lock.lock();
+            for (index_type idx : batch) {
+                slots[idx].next_free = free_head;
+                free_head = idx + 1;
+            }
+            reclaimer->pending -= batch.size();
+            batch.clear();
+            reclaimer->returned.notify_all();
         }
     }
 
+    bool exhausted() const {
+        return free_head == 0 && fresh == N;
+    }
+
+public:
+    // constexpr, чтобы статический пул можно было объявить constinit
+    constexpr MemReserver() = default;
+
+    // delete_ только помечает объект удалённым, деструктор вызывается в фоновом потоке
+    explicit MemReserver(DeferredDestruction) : MemReserver() {
+        reclaimer = std::make_unique<Reclaimer>();
+        reclaimer->retired.reserve(N);
+        reclaimer->worker = std::thread([this] { reclaim_loop(); });
+    }
+
+    MemReserver(const MemReserver&) = delete;
+    MemReserver& operator=(const MemReserver&) = delete;
+
     ~MemReserver() {
-        for (auto& s : slots) {
-            s.destruct();
+        if (reclaimer) {
+            {
+                std::lock_guard<std::mutex> lock(reclaimer->mutex);
+                reclaimer->stopping = true;
+            }
+            reclaimer->wake.notify_one();
+            reclaimer->worker.join();
+        }
+        if constexpr (!trivial_destruction) {
+            for (size_t i = 0; i < fresh; ++i) {
+                slots[i].destruct();
+            }
         }
     }
 
     template <typename... Args>
     T& create(Args&&... args) {
-        if (free_top == 0) {
+        auto lock = lock_free_list();
+        if (exhausted() && reclaimer) {
+            reclaimer->returned.wait(lock, [this] {
+                return !exhausted() || reclaimer->pending == 0;
+            });
+        }
+        if (exhausted()) {
             throw NotEnoughSlotsError(count());
         }
-        size_t idx = free_stack[--free_top];
+        bool reused = free_head != 0;
+        index_type idx = reused ? free_head - 1 : fresh;
+        index_type next = reused ? slots[idx].next_free : 0;
         slots[idx].construct(std::forward<Args>(args)...);
+        if (reused) {
+            free_head = next;
+        } else {
+            ++fresh;
+        }
+        ++created;
         return *slots[idx].obj();
     }
 
@@ -75,12 +200,25 @@ public:
         if (index >= N || !slots[index].occupied) {
             throw EmptySlotError();
         }
+        if (!trivial_destruction && reclaimer) {
+            slots[index].occupied = false;
+            --created;
+            {
+                std::lock_guard<std::mutex> lock(reclaimer->mutex);
+                reclaimer->retired.push_back(static_cast<index_type>(index));
+                ++reclaimer->pending;
+            }
+            reclaimer->wake.notify_one();
+            return;
+        }
         slots[index].destruct();
-        free_stack[free_top++] = index;
+        slots[index].next_free = free_head;
+        free_head = static_cast<index_type>(index + 1);
+        --created;
     }
 
     size_t count() const {
-        return N - free_top;
+        return created;
     }
 
     T& get(size_t index) {
@@ -90,12 +228,546 @@ public:
         return *slots[index].obj();
     }
 
-    size_t position(const T& obj) {
-        for (size_t i = 0; i < N; ++i) {
-            if (slots[i].occupied && &obj == slots[i].obj()) {
-                return i;
+    const T& get(size_t index) const {
+        if (index >= N || !slots[index].occupied) {
+            throw EmptySlotError();
+        }
+        return *slots[index].obj();
+    }
+
+    // Объект лежит в начале своего слота, поэтому номер вычисляется по адресу
+    size_t position(const T& obj) const {
+        auto addr = reinterpret_cast<const char*>(&obj);
+        auto base = reinterpret_cast<const char*>(slots);
+        if (std::less<>()(addr, base) || !std::less<>()(addr, base + sizeof(slots))) {
+            throw EmptySlotError();
+        }
+        size_t offset = static_cast<size_t>(addr - base);
+        size_t index = offset / sizeof(Slot);
+        if (offset % sizeof(Slot) != 0 || !slots[index].occupied) {
+            throw EmptySlotError();
+        }
+        return index;
+    }
+};
+
+// Звено двусвязного списка, встраиваемое в объект. Хранит 32-битные номера
+// соседних слотов MemReserver вместо указателей.
+struct IndexListHook {
+    static constexpr uint32_t nil = std::numeric_limits<uint32_t>::max();
+    uint32_t prev = nil;
+    uint32_t next = nil;
+};
+
+// Интрузивный двусвязный список объектов одного MemReserver
+template <typename T, size_t N, IndexListHook T::*Hook>
+class IndexList {
+    static_assert(N < IndexListHook::nil, "Номера слотов должны помещаться в 32 бита");
+
+private:
+    static constexpr uint32_t nil = IndexListHook::nil;
+
+    MemReserver<T, N>& pool;
+    uint32_t head = nil;
+    uint32_t tail = nil;
+    size_t size_ = 0;
+
+    IndexListHook& hook(uint32_t index) {
+        return pool.get(index).*Hook;
+    }
+
+public:
+    class Iterator {
+    private:
+        IndexList* list;
+        uint32_t index;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+        Iterator(IndexList* l, uint32_t i) : list(l), index(i) {}
+
+        T& operator*() const { return list->pool.get(index); }
+        T* operator->() const { return &list->pool.get(index); }
+
+        Iterator& operator++() {
+            index = list->hook(index).next;
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator temp = *this;
+            ++(*this);
+            return temp;
+        }
+
+        bool operator==(const Iterator& other) const { return index == other.index; }
+        bool operator!=(const Iterator& other) const { return index != other.index; }
+    };
+
+    explicit IndexList(MemReserver<T, N>& p) : pool(p) {}
+
+    Iterator begin() { return Iterator(this, head); }
+    Iterator end() { return Iterator(this, nil); }
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+
+    T& front() {
+        if (empty()) {
+            throw EmptySlotError();
+        }
+        return pool.get(head);
+    }
+
+    T& back() {
+        if (empty()) {
+            throw EmptySlotError();
+        }
+        return pool.get(tail);
+    }
+
+    void push_back(size_t index) {
+        auto idx = static_cast<uint32_t>(index);
+        IndexListHook& h = hook(idx);
+        h.prev = tail;
+        h.next = nil;
+        if (tail != nil) {
+            hook(tail).next = idx;
+        } else {
+            head = idx;
+        }
+        tail = idx;
+        ++size_;
+    }
+
+    void push_front(size_t index) {
+        auto idx = static_cast<uint32_t>(index);
+        IndexListHook& h = hook(idx);
+        h.prev = nil;
+        h.next = head;
+        if (head != nil) {
+            hook(head).prev = idx;
+        } else {
+            tail = idx;
+        }
+        head = idx;
+        ++size_;
+    }
+
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        T& obj = pool.create(std::forward<Args>(args)...);
+        push_back(pool.position(obj));
+        return obj;
+    }
+
+    // Исключает объект из списка, сам объект остаётся в пуле
+    void erase(size_t index) {
+        auto idx = static_cast<uint32_t>(index);
+        IndexListHook& h = hook(idx);
+        if (h.prev != nil) {
+            hook(h.prev).next = h.next;
+        } else {
+            head = h.next;
+        }
+        if (h.next != nil) {
+            hook(h.next).prev = h.prev;
+        } else {
+            tail = h.prev;
+        }
+        h.prev = h.next = nil;
+        --size_;
+    }
+};
+
+// Хеш-индекс с открытой адресацией над объектами MemReserver. Таблица хранит
+// только 32-битные номера слотов, ключ берётся из самого объекта через KeyFn.
+template <typename T, size_t N, typename KeyFn>
+class IndexHashMap {
+    static_assert(N < std::numeric_limits<uint32_t>::max(), "Номера слотов должны помещаться в 32 бита");
+
+public:
+    using key_type = std::remove_cvref_t<std::invoke_result_t<KeyFn, const T&>>;
+
+private:
+    static constexpr uint32_t empty_cell = std::numeric_limits<uint32_t>::max();
+    static constexpr size_t capacity = std::bit_ceil(N * 2 < 2 ? size_t(2) : N * 2);
+
+    MemReserver<T, N>& pool;
+    KeyFn key_of;
+    std::array<uint32_t, capacity> table;
+    size_t size_ = 0;
+
+    static size_t home(const key_type& key) {
+        // Перемешивание нужно, потому что std::hash для целых - тождественная функция
+        uint64_t h = std::hash<key_type>()(key) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(h >> 32) & (capacity - 1);
+    }
+
+    size_t find_cell(const key_type& key) const {
+        for (size_t cell = home(key);; cell = (cell + 1) & (capacity - 1)) {
+            if (table[cell] == empty_cell || key_of(pool.get(table[cell])) == key) {
+                return cell;
             }
         }
-        throw EmptySlotError();
+    }
+
+public:
+    explicit IndexHashMap(MemReserver<T, N>& p, KeyFn fn = KeyFn()) : pool(p), key_of(std::move(fn)) {
+        table.fill(empty_cell);
+    }
+
+    size_t size() const { return size_; }
+
+    // Добавляет объект из пула в индекс; false, если объект с таким ключом уже есть
+    bool insert(size_t index) {
+        size_t cell = find_cell(key_of(pool.get(index)));
+        if (table[cell] != empty_cell) {
+            return false;
+        }
+        table[cell] = static_cast<uint32_t>(index);
+        ++size_;
+        return true;
+    }
+
+    template <typename... Args>
+    T& emplace(Args&&... args) {
+        T& obj = pool.create(std::forward<Args>(args)...);
+        size_t index = pool.position(obj);
+        if (!insert(index)) {
+            pool.delete_(index);
+            throw std::invalid_argument("Объект с таким ключом уже есть в индексе");
+        }
+        return obj;
+    }
+
+    T* find(const key_type& key) {
+        size_t cell = find_cell(key);
+        return table[cell] == empty_cell ? nullptr : &pool.get(table[cell]);
+    }
+
+    bool contains(const key_type& key) const {
+        return table[find_cell(key)] != empty_cell;
+    }
+
+    // Убирает ключ из индекса (объект остаётся в пуле). Хвост кластера
+    // сдвигается назад, поэтому надгробия не нужны.
+    bool erase(const key_type& key) {
+        size_t hole = find_cell(key);
+        if (table[hole] == empty_cell) {
+            return false;
+        }
+        size_t cell = hole;
+        while (true) {
+            cell = (cell + 1) & (capacity - 1);
+            if (table[cell] == empty_cell) {
+                break;
+            }
+            size_t want = home(key_of(pool.get(table[cell])));
+            if (((cell - want) & (capacity - 1)) >= ((cell - hole) & (capacity - 1))) {
+                table[hole] = table[cell];
+                hole = cell;
+            }
+        }
+        table[hole] = empty_cell;
+        --size_;
+        return true;
     }
 };
+
+// Вариант MemReserver, размещённый в разделяемой памяти (POSIX shm, memfd или
+// анонимное отображение, наследуемое при fork). Вместо указателей выдаются
+// смещения объектов от начала сегмента, список свободных слотов lock-free.
+template <typename T, size_t N>
+class SharedMemReserver {
+    static_assert(std::is_trivially_copyable_v<T>, "Объекты в разделяемой памяти должны быть trivially copyable");
+    static_assert(N < std::numeric_limits<uint32_t>::max(), "Слишком много слотов");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free);
+
+public:
+    using handle_type = uint64_t;
+
+private:
+    enum : uint32_t { Free = 0, Constructing = 1, Occupied = 2 };
+
+    struct Slot {
+        std::atomic<uint32_t> next_free;
+        std::atomic<uint32_t> state;
+        alignas(T) unsigned char data[sizeof(T)];
+    };
+
+    // Нулевой сегмент - корректный пустой пул, поэтому процессам не нужно
+    // договариваться, кто его инициализирует. free_head: младшие 32 бита -
+    // номер слота плюс один (0 - список пуст), старшие - счётчик против ABA.
+    struct Segment {
+        alignas(64) std::atomic<uint64_t> free_head;
+        std::atomic<uint32_t> fresh;
+        std::atomic<uint32_t> created;
+        alignas(64) Slot slots[N];
+    };
+
+    Segment* segment = nullptr;
+
+    static constexpr size_t segment_size = sizeof(Segment);
+
+    void map(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            throw std::system_error(errno, std::generic_category(), "fstat");
+        }
+        if (static_cast<size_t>(st.st_size) < segment_size && ftruncate(fd, segment_size) != 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate");
+        }
+        void* addr = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+        segment = static_cast<Segment*>(addr);
+    }
+
+    size_t index_of(handle_type handle) const {
+        size_t first = offsetof(Segment, slots) + offsetof(Slot, data);
+        if (handle < first || (handle - first) % sizeof(Slot) != 0) {
+            throw EmptySlotError();
+        }
+        size_t index = (handle - first) / sizeof(Slot);
+        if (index >= N) {
+            throw EmptySlotError();
+        }
+        return index;
+    }
+
+    bool pop_free(uint32_t& index) {
+        uint64_t head = segment->free_head.load(std::memory_order_acquire);
+        while (static_cast<uint32_t>(head) != 0) {
+            uint32_t idx = static_cast<uint32_t>(head) - 1;
+            uint32_t next = segment->slots[idx].next_free.load(std::memory_order_relaxed);
+            uint64_t tagged = ((head >> 32) + 1) << 32 | next;
+            if (segment->free_head.compare_exchange_weak(head, tagged, std::memory_order_acquire)) {
+                index = idx;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void push_free(uint32_t index) {
+        uint64_t head = segment->free_head.load(std::memory_order_relaxed);
+        uint64_t tagged;
+        do {
+            segment->slots[index].next_free.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+            tagged = ((head >> 32) + 1) << 32 | (index + 1);
+        } while (!segment->free_head.compare_exchange_weak(head, tagged, std::memory_order_release));
+    }
+
+    bool take_fresh(uint32_t& index) {
+        uint32_t f = segment->fresh.load(std::memory_order_relaxed);
+        while (f < N) {
+            if (segment->fresh.compare_exchange_weak(f, f + 1, std::memory_order_relaxed)) {
+                index = f;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    // Анонимный сегмент: общий для процесса и всех его потомков после fork()
+    SharedMemReserver() {
+        void* addr = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+        segment = static_cast<Segment*>(addr);
+    }
+
+    // Именованный сегмент POSIX shm: создаётся первым открывшим его процессом
+    explicit SharedMemReserver(const std::string& name) {
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "shm_open");
+        }
+        try {
+            map(fd);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+
+    // Готовый дескриптор, например из memfd_create или полученный через сокет
+    explicit SharedMemReserver(int fd) {
+        map(fd);
+    }
+
+    SharedMemReserver(const SharedMemReserver&) = delete;
+    SharedMemReserver& operator=(const SharedMemReserver&) = delete;
+
+    ~SharedMemReserver() {
+        munmap(segment, segment_size);
+    }
+
+    static void unlink(const std::string& name) {
+        shm_unlink(name.c_str());
+    }
+
+    template <typename... Args>
+    handle_type create(Args&&... args) {
+        uint32_t idx;
+        if (!pop_free(idx) && !take_fresh(idx)) {
+            throw NotEnoughSlotsError(count());
+        }
+        Slot& slot = segment->slots[idx];
+        slot.state.store(Constructing, std::memory_order_relaxed);
+        new (slot.data) T(std::forward<Args>(args)...);
+        slot.state.store(Occupied, std::memory_order_release);
+        segment->created.fetch_add(1, std::memory_order_relaxed);
+        return offsetof(Segment, slots) + idx * sizeof(Slot) + offsetof(Slot, data);
+    }
+
+    void delete_(handle_type handle) {
+        size_t idx = index_of(handle);
+        uint32_t expected = Occupied;
+        if (!segment->slots[idx].state.compare_exchange_strong(expected, Free, std::memory_order_acq_rel)) {
+            throw EmptySlotError();
+        }
+        segment->created.fetch_sub(1, std::memory_order_relaxed);
+        push_free(static_cast<uint32_t>(idx));
+    }
+
+    size_t count() const {
+        return segment->created.load(std::memory_order_relaxed);
+    }
+
+    T& get(handle_type handle) {
+        size_t idx = index_of(handle);
+        if (segment->slots[idx].state.load(std::memory_order_acquire) != Occupied) {
+            throw EmptySlotError();
+        }
+        return *std::launder(reinterpret_cast<T*>(segment->slots[idx].data));
+    }
+
+    // Как и у MemReserver, чужой или удалённый объект - ошибка
+    handle_type position(const T& obj) const {
+        auto addr = reinterpret_cast<const unsigned char*>(&obj);
+        auto base = reinterpret_cast<const unsigned char*>(segment);
+        if (std::less<>()(addr, base) || !std::less<>()(addr, base + segment_size)) {
+            throw EmptySlotError();
+        }
+        handle_type handle = static_cast<handle_type>(addr - base);
+        size_t idx = index_of(handle);
+        if (segment->slots[idx].state.load(std::memory_order_acquire) != Occupied) {
+            throw EmptySlotError();
+        }
+        return handle;
+    }
+};
+
+#ifdef MEMRESERVER_SELFTEST
+// Проверка SharedMemReserver несколькими процессами:
+// g++ -std=c++20 -DMEMRESERVER_SELFTEST MemResever.cpp && ./a.out
+#include <algorithm>
+#include <iostream>
+#include <sys/wait.h>
+
+int main() {
+    struct Item {
+        uint64_t owner;
+        uint64_t value;
+    };
+    constexpr size_t slots = 64;
+    constexpr int processes = 4;
+    constexpr int rounds = 20000;
+    SharedMemReserver<Item, slots> pool;
+
+    std::vector<pid_t> children;
+    for (int p = 0; p < processes; ++p) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "fork failed" << std::endl;
+            return 1;
+        }
+        if (pid == 0) {
+            // Каждый процесс держит до 8 своих объектов и проверяет, что их никто не испортил
+            std::vector<std::pair<uint64_t, uint64_t>> held;
+            for (int i = 0; i < rounds; ++i) {
+                try {
+                    if (held.size() < 8) {
+                        uint64_t value = static_cast<uint64_t>(p) << 32 | static_cast<uint32_t>(i);
+                        auto handle = pool.create(Item{static_cast<uint64_t>(p), value});
+                        held.emplace_back(handle, value);
+                    }
+                } catch (const NotEnoughSlotsError&) {
+                }
+                if (held.empty() || (i % 3 != 0 && held.size() < 8)) {
+                    continue;
+                }
+                auto [handle, value] = held.front();
+                held.erase(held.begin());
+                Item& item = pool.get(handle);
+                if (item.owner != static_cast<uint64_t>(p) || item.value != value || pool.position(item) != handle) {
+                    _exit(2);
+                }
+                pool.delete_(handle);
+            }
+            for (auto [handle, value] : held) {
+                if (pool.get(handle).value != value) {
+                    _exit(2);
+                }
+                pool.delete_(handle);
+            }
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+
+    bool childrenOk = true;
+    for (pid_t pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        childrenOk = childrenOk && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    std::cout << "Children finished without corruption: " << std::boolalpha << childrenOk << std::endl;
+    std::cout << "Pool empty after all processes: " << (pool.count() == 0) << std::endl;
+
+    // Список свободных слотов после гонок цел: все слоты снова выдаются, и ни одним больше
+    std::vector<uint64_t> handles;
+    for (size_t i = 0; i < slots; ++i) {
+        handles.push_back(pool.create(Item{0, i}));
+    }
+    bool overflow = false;
+    try {
+        pool.create(Item{});
+    } catch (const NotEnoughSlotsError&) {
+        overflow = true;
+    }
+    std::sort(handles.begin(), handles.end());
+    bool distinct = std::adjacent_find(handles.begin(), handles.end()) == handles.end();
+    std::cout << "All slots reusable and distinct: " << (distinct && overflow) << std::endl;
+
+    Item foreign{};
+    bool foreignRejected = false;
+    try {
+        pool.position(foreign);
+    } catch (const EmptySlotError&) {
+        foreignRejected = true;
+    }
+    Item& last = pool.get(handles.back());
+    pool.delete_(handles.back());
+    bool deletedRejected = false;
+    try {
+        pool.position(last);
+    } catch (const EmptySlotError&) {
+        deletedRejected = true;
+    }
+    std::cout << "position rejects foreign and deleted objects: " << (foreignRejected && deletedRejected) << std::endl;
+
+    return childrenOk && pool.count() == slots - 1 && distinct && overflow && foreignRejected && deletedRejected ? 0 : 1;
+}
+#endif
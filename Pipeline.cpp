@@ -6,6 +6,516 @@
 #include <list>
 #include <array>
 #include <typeinfo>
+#include <stdexcept>
+#include <iterator>
+#include <thread>
+#include <exception>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <any>
+#include <typeindex>
+#include <unordered_map>
+#include <sstream>
+#include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <limits>
+#include <bit>
+#include <cmath>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <span>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "SimpleRNG.hpp"
+
+namespace pl {
+
+class PipelineCancelledError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Флаг отмены, общий для всех копий токена
+class CancellationToken {
+private:
+    std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+
+public:
+    void cancel() const { flag->store(true, std::memory_order_relaxed); }
+    bool cancelled() const { return flag->load(std::memory_order_relaxed); }
+};
+
+// Ограничения на один запуск пайплайна. Бюджет считает элементы, прошедшие
+// через шаги-обработчики контейнеров, и проверяется с точностью до пачки.
+struct ExecutionLimits {
+    CancellationToken token;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    size_t item_budget = SIZE_MAX;
+};
+
+namespace detail {
+
+// Шаги проверяют ограничения раз в check_interval элементов, а не на каждом
+constexpr size_t check_interval = 4096;
+
+class ExecutionContext {
+private:
+    const ExecutionLimits& limits;
+    std::atomic<size_t> items{0};
+    std::atomic<bool> stopped{false};
+
+    [[noreturn]] void stop(const char* reason) {
+        stopped.store(true, std::memory_order_relaxed);
+        throw PipelineCancelledError(reason);
+    }
+
+public:
+    explicit ExecutionContext(const ExecutionLimits& l) : limits(l) {}
+
+    void check(size_t processed) {
+        if (stopped.load(std::memory_order_relaxed)) {
+            throw PipelineCancelledError("Pipeline execution stopped");
+        }
+        if (limits.token.cancelled()) {
+            stop("Pipeline execution cancelled");
+        }
+        if (processed != 0 && items.fetch_add(processed, std::memory_order_relaxed) + processed > limits.item_budget) {
+            stop("Pipeline item budget exceeded");
+        }
+        if (limits.deadline != std::chrono::steady_clock::time_point::max()
+            && std::chrono::steady_clock::now() >= limits.deadline) {
+            stop("Pipeline deadline exceeded");
+        }
+    }
+};
+
+inline thread_local ExecutionContext* current_context = nullptr;
+
+// Делает контекст текущим для потока на время своей жизни
+class ContextScope {
+private:
+    ExecutionContext* saved;
+
+public:
+    explicit ContextScope(ExecutionContext* context) : saved(current_context) { current_context = context; }
+    ~ContextScope() { current_context = saved; }
+    ContextScope(const ContextScope&) = delete;
+    ContextScope& operator=(const ContextScope&) = delete;
+};
+
+inline void checkpoint(size_t processed = 0) {
+    if (current_context) {
+        current_context->check(processed);
+    }
+}
+
+// Счётчик для циклов по элементам: вызывает checkpoint раз в check_interval итераций
+class BatchCheck {
+private:
+    size_t pending = 0;
+
+public:
+    void operator()() {
+        if (++pending == check_interval) {
+            checkpoint(pending);
+            pending = 0;
+        }
+    }
+};
+
+template<typename T>
+struct is_vector : std::false_type {};
+
+template<typename T, typename A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+
+} // namespace detail
+
+// Обращения к пулу буферов пайплайна: hits - выданы готовые буферы,
+// misses - пул был пуст и создан новый вектор, returned - буферы вернулись в пул
+struct BufferPoolStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t returned = 0;
+    size_t returned_bytes = 0;  // суммарная ёмкость возвращённых буферов
+};
+
+namespace detail {
+
+// Освободившиеся промежуточные векторы одного пайплайна. Шаг, дочитавший
+// свой вход, отдаёт буфер сюда, а следующий шаг или следующий запуск берёт
+// его вместо выделения нового; в установившемся режиме запуски не
+// выделяют память. Пул защищён мьютексом, потому что run() одного
+// пайплайна можно вызывать из нескольких потоков.
+class BufferPool {
+private:
+    static constexpr size_t max_per_type = 8;
+
+    struct ShelfBase {
+        virtual ~ShelfBase() = default;
+    };
+
+    template<typename V>
+    struct Shelf : ShelfBase {
+        std::vector<V> buffers;
+        Shelf() { buffers.reserve(max_per_type); }
+    };
+
+    mutable std::mutex mutex;
+    std::vector<std::pair<std::type_index, std::unique_ptr<ShelfBase>>> shelves;
+    BufferPoolStats counters;
+
+    template<typename V>
+    Shelf<V>& shelf() {
+        for (auto& [type, stored] : shelves) {
+            if (type == typeid(V)) {
+                return static_cast<Shelf<V>&>(*stored);
+            }
+        }
+        shelves.emplace_back(typeid(V), std::make_unique<Shelf<V>>());
+        return static_cast<Shelf<V>&>(*shelves.back().second);
+    }
+
+public:
+    template<typename V>
+    V take() {
+        std::lock_guard lock(mutex);
+        auto& buffers = shelf<V>().buffers;
+        if (buffers.empty()) {
+            ++counters.misses;
+            return V();
+        }
+        ++counters.hits;
+        V buffer = std::move(buffers.back());
+        buffers.pop_back();
+        return buffer;
+    }
+
+    template<typename V>
+    void give(V& buffer) {
+        if (buffer.capacity() == 0) {
+            return;
+        }
+        std::lock_guard lock(mutex);
+        auto& buffers = shelf<V>().buffers;
+        if (buffers.size() < max_per_type) {
+            buffer.clear();
+            counters.returned_bytes += buffer.capacity() * sizeof(typename V::value_type);
+            buffers.push_back(std::move(buffer));
+            ++counters.returned;
+        }
+    }
+
+    BufferPoolStats stats() const {
+        std::lock_guard lock(mutex);
+        return counters;
+    }
+};
+
+inline thread_local BufferPool* current_pool = nullptr;
+
+class PoolScope {
+private:
+    BufferPool* saved;
+
+public:
+    explicit PoolScope(BufferPool* pool) : saved(current_pool) { current_pool = pool; }
+    ~PoolScope() { current_pool = saved; }
+    PoolScope(const PoolScope&) = delete;
+    PoolScope& operator=(const PoolScope&) = delete;
+};
+
+// Пустой вектор, по возможности с ёмкостью из пула текущего запуска
+template<typename V>
+V take_buffer() {
+    if (current_pool) {
+        return current_pool->take<V>();
+    }
+    return V();
+}
+
+template<typename T>
+void recycle(T& value) {
+    if constexpr (is_vector<T>::value) {
+        if (current_pool) {
+            current_pool->give(value);
+        }
+    }
+}
+
+} // namespace detail
+
+// Арифметические выражения с заполнителем: _1 * 3 + 7. Узлы выражения -
+// обычные constexpr-функторы, а цепочка таких шагов в пайплайне собирается
+// подстановкой в одно выражение ещё на этапе компиляции.
+struct AddOp { static constexpr auto apply(const auto& a, const auto& b) { return a + b; } };
+struct SubOp { static constexpr auto apply(const auto& a, const auto& b) { return a - b; } };
+struct MulOp { static constexpr auto apply(const auto& a, const auto& b) { return a * b; } };
+struct DivOp { static constexpr auto apply(const auto& a, const auto& b) { return a / b; } };
+
+struct Placeholder {
+    template<typename X>
+    constexpr X operator()(const X& x) const { return x; }
+};
+
+template<typename V>
+struct Constant {
+    V value;
+
+    template<typename X>
+    constexpr V operator()(const X&) const { return value; }
+};
+
+template<typename Op, typename L, typename R>
+struct Binary {
+    using op = Op;
+    L left;
+    R right;
+
+    template<typename X>
+    constexpr auto operator()(const X& x) const { return Op::apply(left(x), right(x)); }
+};
+
+template<typename T>
+struct is_expression : std::false_type {};
+template<>
+struct is_expression<Placeholder> : std::true_type {};
+template<typename V>
+struct is_expression<Constant<V>> : std::true_type {};
+template<typename Op, typename L, typename R>
+struct is_expression<Binary<Op, L, R>> : std::true_type {};
+
+template<typename T>
+concept Expression = is_expression<std::remove_cvref_t<T>>::value;
+
+template<typename T>
+struct is_constant : std::false_type {};
+template<typename V>
+struct is_constant<Constant<V>> : std::true_type {};
+
+// Строит узел; если оба операнда - константы, сразу вычисляет его. Это
+// точно: без свёртки узел вычислял бы то же самое в тех же типах.
+// Перестановки с участием заполнителя зависят от типа входа, см. fold_for.
+template<typename Op, typename L, typename R>
+constexpr auto make_binary(const L& l, const R& r) {
+    if constexpr (is_constant<L>::value && is_constant<R>::value) {
+        return Constant<decltype(Op::apply(l.value, r.value))>{Op::apply(l.value, r.value)};
+    } else {
+        return Binary<Op, L, R>{l, r};
+    }
+}
+
+template<typename V>
+constexpr auto as_expression(const V& v) {
+    if constexpr (Expression<V>) {
+        return v;
+    } else {
+        return Constant<V>{v};
+    }
+}
+
+template<typename L, typename R>
+concept ExpressionOperands = (Expression<L> || Expression<R>)
+    && (Expression<L> || std::is_arithmetic_v<std::remove_cvref_t<L>>)
+    && (Expression<R> || std::is_arithmetic_v<std::remove_cvref_t<R>>);
+
+template<typename L, typename R> requires ExpressionOperands<L, R>
+constexpr auto operator+(const L& l, const R& r) { return make_binary<AddOp>(as_expression(l), as_expression(r)); }
+
+template<typename L, typename R> requires ExpressionOperands<L, R>
+constexpr auto operator-(const L& l, const R& r) { return make_binary<SubOp>(as_expression(l), as_expression(r)); }
+
+template<typename L, typename R> requires ExpressionOperands<L, R>
+constexpr auto operator*(const L& l, const R& r) { return make_binary<MulOp>(as_expression(l), as_expression(r)); }
+
+template<typename L, typename R> requires ExpressionOperands<L, R>
+constexpr auto operator/(const L& l, const R& r) { return make_binary<DivOp>(as_expression(l), as_expression(r)); }
+
+// Подставляет inner вместо заполнителя в outer
+template<typename Outer, typename Inner>
+constexpr auto substitute(const Outer& outer, const Inner& inner) {
+    if constexpr (std::is_same_v<Outer, Placeholder>) {
+        return inner;
+    } else if constexpr (is_constant<Outer>::value) {
+        return outer;
+    } else {
+        return make_binary<typename Outer::op>(substitute(outer.left, inner), substitute(outer.right, inner));
+    }
+}
+
+// Выражение, эквивалентное применению first, а затем second
+template<typename First, typename Second>
+constexpr auto then(const First& first, const Second& second) {
+    return substitute(second, first);
+}
+
+namespace detail {
+
+template<typename E>
+struct is_binary : std::false_type {};
+template<typename Op, typename L, typename R>
+struct is_binary<Binary<Op, L, R>> : std::true_type {};
+
+template<typename T, typename Op, typename L, typename R>
+constexpr auto fold_node(const L& l, const R& r);
+
+// Узел l op r, где l = y op1 c1, r = c2, и всё вычисляется в одном
+// беззнаковом типе X: арифметика по модулю 2^n, поэтому перестановки точны
+template<typename T, typename Op, typename L, typename R>
+constexpr bool reassociable() {
+    if constexpr (is_binary<L>::value && is_constant<R>::value) {
+        if constexpr (is_constant<std::remove_cvref_t<decltype(std::declval<const L&>().right)>>::value) {
+            using X = decltype(std::declval<const L&>()(std::declval<const T&>()));
+            using Q = decltype(Op::apply(std::declval<X>(), std::declval<const R&>().value));
+            return std::is_integral_v<X> && std::is_unsigned_v<X> && std::is_same_v<X, Q>;
+        }
+    }
+    return false;
+}
+
+template<typename T, typename Op, typename L, typename R>
+constexpr auto fold_node(const L& l, const R& r) {
+    if constexpr (is_constant<L>::value && is_constant<R>::value) {
+        return make_binary<Op>(l, r);
+    } else if constexpr (reassociable<T, Op, L, R>()) {
+        using X = decltype(l(std::declval<const T&>()));
+        using Inner = typename L::op;
+        const Constant<X> c1{static_cast<X>(l.right.value)};
+        const Constant<X> c2{static_cast<X>(r.value)};
+        if constexpr ((std::is_same_v<Op, AddOp> || std::is_same_v<Op, MulOp>) && std::is_same_v<Inner, Op>) {
+            // (y + c1) + c2 -> y + (c1 + c2); (y * c1) * c2 -> y * (c1 * c2)
+            return fold_node<T, Op>(l.left, make_binary<Op>(c1, c2));
+        } else if constexpr (std::is_same_v<Op, MulOp> && std::is_same_v<Inner, AddOp>) {
+            // (y + c1) * c2 -> y * c2 + c1 * c2
+            return fold_node<T, AddOp>(fold_node<T, MulOp>(l.left, c2), make_binary<MulOp>(c1, c2));
+        } else {
+            return Binary<Op, L, R>{l, r};
+        }
+    } else {
+        return Binary<Op, L, R>{l, r};
+    }
+}
+
+} // namespace detail
+
+// Сворачивает константы выражения для входа типа T. Перестановки делаются
+// только для беззнаковых целых: для знаковых они могут внести переполнение,
+// которого в исходном порядке не было, а для чисел с плавающей точкой и для
+// более широкого типа входа, чем у констант, меняют результат.
+template<typename T, typename E>
+constexpr auto fold_for(const E& e) {
+    if constexpr (detail::is_binary<E>::value) {
+        return detail::fold_node<T, typename E::op>(fold_for<T>(e.left), fold_for<T>(e.right));
+    } else {
+        return e;
+    }
+}
+
+namespace placeholders {
+inline constexpr Placeholder _1{};
+}
+
+// Поэлементное применение выражения к контейнеру. Внутренний цикл без
+// проверок и косвенных вызовов, поэтому компилятор векторизует его.
+template<typename E>
+struct EachStep {
+    E expr;
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        std::vector<std::decay_t<decltype(expr(std::declval<const Value&>()))>> result(std::size(container));
+        if constexpr (std::contiguous_iterator<decltype(std::begin(container))>) {
+            const Value* in = std::to_address(std::begin(container));
+            auto* out = result.data();
+            for (size_t begin = 0; begin < result.size(); begin += detail::check_interval) {
+                size_t end = std::min(result.size(), begin + detail::check_interval);
+                detail::checkpoint(end - begin);
+                for (size_t i = begin; i < end; ++i) {
+                    out[i] = expr(in[i]);
+                }
+            }
+        } else {
+            detail::BatchCheck check;
+            size_t i = 0;
+            for (const auto& elem : container) {
+                check();
+                result[i++] = expr(elem);
+            }
+        }
+        return result;
+    }
+};
+
+template<typename T>
+struct is_each_step : std::false_type {};
+template<typename E>
+struct is_each_step<EachStep<E>> : std::true_type {};
+
+template<Expression E>
+EachStep<E> each(const E& expr) { return EachStep<E>{expr}; }
+
+template<typename T, typename E, bool Elementwise>
+class ExprPipeline;
+
+// Пайплайн, который вычисляет каждый шаг сразу при добавлении и хранит только
+// значение: без unique_ptr, виртуальных шагов и std::function. Поэтому он
+// целиком вычисляется во время компиляции, если вход и шаги constexpr.
+template<typename T>
+class ConstPipeline {
+private:
+    T result;
+
+public:
+    constexpr explicit ConstPipeline(T value) : result(std::move(value)) {}
+
+    constexpr const T& value() const { return result; }
+
+    template<typename F>
+    constexpr auto operator|(F&& func) const {
+        using Out = decltype(func(result));
+        if constexpr (std::is_void_v<Out>) {
+            func(result);
+        } else {
+            return ConstPipeline<std::decay_t<Out>>(func(result));
+        }
+    }
+};
+
+template<typename T>
+constexpr ConstPipeline<T> constant(T value) {
+    return ConstPipeline<T>(std::move(value));
+}
+
+// Таблица значений f(0), ..., f(N - 1), которую удобно строить как constexpr
+template<size_t N, typename F>
+constexpr auto table(F f) {
+    std::array<std::decay_t<decltype(f(size_t(0)))>, N> result{};
+    for (size_t i = 0; i < N; ++i) {
+        result[i] = f(i);
+    }
+    return result;
+}
+
+} // namespace pl
 
 class PipelineStepBase {
 public:
@@ -13,8 +523,28 @@ public:
     virtual ~PipelineStepBase() = default;
 };
 
+// Шаг, который умеет вычислить своё значение без изменения состояния.
+// Промежуточные значения живут на стеке вызывающего, поэтому один собранный
+// пайплайн можно одновременно вычислять из нескольких потоков.
+// source - подменённое входное значение (nullptr - взять из InitialStep).
+template<typename T>
+class ValueStep : public PipelineStepBase {
+public:
+    virtual T evaluate(const void* source) const = 0;
+    virtual const std::type_info& sourceType() const = 0;
+};
+
+template<typename T>
+const ValueStep<T>& asValueStep(const std::unique_ptr<PipelineStepBase>& step) {
+    auto* valueStep = dynamic_cast<const ValueStep<T>*>(step.get());
+    if (!valueStep) {
+        throw std::runtime_error("Cannot get value from previous step");
+    }
+    return *valueStep;
+}
+
 template<typename T>
-class InitialStep : public PipelineStepBase {
+class InitialStep : public ValueStep<T> {
 private:
     T value;
     bool executed = false;
@@ -24,6 +554,18 @@ public:
         executed = true;
     }
     T getValue() const { return value; }
+
+    T evaluate(const void* source) const override {
+        const T& from = source ? *static_cast<const T*>(source) : value;
+        if constexpr (pl::detail::is_vector<T>::value) {
+            T copy = pl::detail::take_buffer<T>();
+            copy = from;
+            return copy;
+        } else {
+            return from;
+        }
+    }
+    const std::type_info& sourceType() const override { return typeid(T); }
 };
 
 class IResultHolder {
@@ -39,7 +581,7 @@ private:
     
 public:
     void setResult(T res) {
-        result = res;
+        result = std::move(res);
         has_result = true;
     }
     
@@ -52,19 +594,30 @@ public:
 };
 
 template<typename In, typename Out>
-class TransformStep : public PipelineStepBase, public ResultHolder<Out> {
+class TransformStep : public ValueStep<Out>, public ResultHolder<Out> {
 private:
     std::unique_ptr<PipelineStepBase> previous;
-    std::function<Out(In)> func;
+    const ValueStep<In>* previousValue;
+    std::function<Out(In&&)> func;
     bool executed = false;
     
 public:
-    TransformStep(std::unique_ptr<PipelineStepBase> prev, std::function<Out(In)> f) 
-        : previous(std::move(prev)), func(f) {}
+    TransformStep(std::unique_ptr<PipelineStepBase> prev, std::function<Out(In&&)> f) 
+        : previous(std::move(prev)), previousValue(&asValueStep<In>(previous)), func(f) {}
+
+    Out evaluate(const void* source) const override {
+        In input_value = previousValue->evaluate(source);
+        pl::detail::checkpoint();
+        Out result = func(std::move(input_value));
+        pl::detail::recycle(input_value);
+        return result;
+    }
+    const std::type_info& sourceType() const override { return previousValue->sourceType(); }
     
     void execute() override {
         if (!executed) {
             previous->execute();
+            pl::detail::checkpoint();
           
             In input_value;
             
@@ -78,26 +631,35 @@ public:
                 throw std::runtime_error("Cannot get value from previous step");
             }
             
-            this->setResult(func(input_value));
+            this->setResult(func(std::move(input_value)));
             executed = true;
         }
     }
 };
 
 template<typename In>
-class TerminalStep : public PipelineStepBase {
+class TerminalStep : public ValueStep<void> {
 private:
     std::unique_ptr<PipelineStepBase> previous;
-    std::function<void(In)> func;
+    const ValueStep<In>* previousValue;
+    std::function<void(In&&)> func;
     bool executed = false;
     
 public:
-    TerminalStep(std::unique_ptr<PipelineStepBase> prev, std::function<void(In)> f) 
-        : previous(std::move(prev)), func(f) {}
+    TerminalStep(std::unique_ptr<PipelineStepBase> prev, std::function<void(In&&)> f) 
+        : previous(std::move(prev)), previousValue(&asValueStep<In>(previous)), func(f) {}
+
+    void evaluate(const void* source) const override {
+        In input_value = previousValue->evaluate(source);
+        pl::detail::checkpoint();
+        func(std::move(input_value));
+    }
+    const std::type_info& sourceType() const override { return previousValue->sourceType(); }
     
     void execute() override {
         if (!executed) {
             previous->execute();
+            pl::detail::checkpoint();
           
             In input_value;
             
@@ -111,7 +673,7 @@ public:
                 throw std::runtime_error("Cannot get value from previous step");
             }
             
-            func(input_value);
+            func(std::move(input_value));
             executed = true;
         }
     }
@@ -122,6 +684,7 @@ class Pipeline {
 private:
     std::unique_ptr<PipelineStepBase> step;
     bool immediate_execution;
+    std::unique_ptr<pl::detail::BufferPool> buffers = std::make_unique<pl::detail::BufferPool>();
     
 public:
     Pipeline(std::unique_ptr<PipelineStepBase> s, bool immediate = false) 
@@ -139,6 +702,55 @@ public:
     void execute() {
         step->execute();
     }
+
+    // Запуск с отменой, дедлайном и бюджетом; при превышении бросает
+    // pl::PipelineCancelledError, и пайплайн можно запустить заново.
+    void execute(const pl::ExecutionLimits& limits) {
+        pl::detail::ExecutionContext context(limits);
+        pl::detail::ContextScope scope(&context);
+        step->execute();
+    }
+
+    pl::BufferPoolStats buffer_stats() const {
+        return buffers->stats();
+    }
+
+    // Вычисление без изменения состояния пайплайна: можно вызывать
+    // одновременно из разных потоков, если сами шаги потокобезопасны.
+    T run() const {
+        pl::detail::PoolScope pool(buffers.get());
+        return asValueStep<T>(step).evaluate(nullptr);
+    }
+
+    // То же, но с другим входным значением вместо заданного при сборке
+    template<typename S>
+    T run(const S& input) const {
+        const auto& valueStep = asValueStep<T>(step);
+        if (valueStep.sourceType() != typeid(S)) {
+            throw std::runtime_error("Pipeline input type mismatch");
+        }
+        pl::detail::PoolScope pool(buffers.get());
+        return valueStep.evaluate(&input);
+    }
+
+    // Пачка входов: поиск последнего шага, проверка типа и установка пула
+    // делаются один раз. Результат i-го входа передаётся в done(i, value),
+    // исключение - в failed(i, error); остальные входы продолжают считаться.
+    template<typename S, typename Done, typename Failed>
+    void run_each(std::span<const S> inputs, Done&& done, Failed&& failed) const {
+        const auto& valueStep = asValueStep<T>(step);
+        if (valueStep.sourceType() != typeid(S)) {
+            throw std::runtime_error("Pipeline input type mismatch");
+        }
+        pl::detail::PoolScope pool(buffers.get());
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            try {
+                done(i, valueStep.evaluate(&inputs[i]));
+            } catch (...) {
+                failed(i, std::current_exception());
+            }
+        }
+    }
     
     void operator()() {
         execute();
@@ -149,7 +761,11 @@ public:
         using InputType = T;
         using FunctionResult = decltype(func(std::declval<InputType>()));
         
-        if constexpr (std::is_void_v<FunctionResult>) {
+        if constexpr (pl::Expression<F>) {
+            return pl::ExprPipeline<T, std::decay_t<F>, false>(std::move(*this), func);
+        } else if constexpr (pl::is_each_step<std::decay_t<F>>::value) {
+            return pl::ExprPipeline<T, decltype(func.expr), true>(std::move(*this), func.expr);
+        } else if constexpr (std::is_void_v<FunctionResult>) {
             auto terminalStep = std::make_unique<TerminalStep<InputType>>(
                 std::move(step), std::forward<F>(func));
             return Pipeline<void>(std::move(terminalStep), immediate_execution);
@@ -166,6 +782,7 @@ class Pipeline<void> {
 private:
     std::unique_ptr<PipelineStepBase> step;
     bool immediate_execution;
+    std::unique_ptr<pl::detail::BufferPool> buffers = std::make_unique<pl::detail::BufferPool>();
     
 public:
     Pipeline(std::unique_ptr<PipelineStepBase> s, bool immediate = false) 
@@ -183,6 +800,50 @@ public:
     void execute() {
         step->execute();
     }
+
+    // Запуск с отменой, дедлайном и бюджетом; при превышении бросает
+    // pl::PipelineCancelledError, и пайплайн можно запустить заново.
+    void execute(const pl::ExecutionLimits& limits) {
+        pl::detail::ExecutionContext context(limits);
+        pl::detail::ContextScope scope(&context);
+        step->execute();
+    }
+
+    pl::BufferPoolStats buffer_stats() const {
+        return buffers->stats();
+    }
+
+    void run() const {
+        pl::detail::PoolScope pool(buffers.get());
+        asValueStep<void>(step).evaluate(nullptr);
+    }
+
+    template<typename S>
+    void run(const S& input) const {
+        const auto& valueStep = asValueStep<void>(step);
+        if (valueStep.sourceType() != typeid(S)) {
+            throw std::runtime_error("Pipeline input type mismatch");
+        }
+        pl::detail::PoolScope pool(buffers.get());
+        valueStep.evaluate(&input);
+    }
+
+    template<typename S, typename Done, typename Failed>
+    void run_each(std::span<const S> inputs, Done&& done, Failed&& failed) const {
+        const auto& valueStep = asValueStep<void>(step);
+        if (valueStep.sourceType() != typeid(S)) {
+            throw std::runtime_error("Pipeline input type mismatch");
+        }
+        pl::detail::PoolScope pool(buffers.get());
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            try {
+                valueStep.evaluate(&inputs[i]);
+                done(i);
+            } catch (...) {
+                failed(i, std::current_exception());
+            }
+        }
+    }
     
     void operator()() {
         execute();
@@ -191,17 +852,26 @@ public:
     // Для void пайплайна можно добавлять только терминальные операции
     template<typename F>
     auto operator|(F&& func) {
-        struct SequentialStep : public PipelineStepBase {
+        struct SequentialStep : public ValueStep<void> {
             std::unique_ptr<PipelineStepBase> prev;
+            const ValueStep<void>* prevValue;
             std::function<void()> action;
             bool executed = false;
             
             SequentialStep(std::unique_ptr<PipelineStepBase> p, std::function<void()> f) 
-                : prev(std::move(p)), action(f) {}
+                : prev(std::move(p)), prevValue(&asValueStep<void>(prev)), action(f) {}
+
+            void evaluate(const void* source) const override {
+                prevValue->evaluate(source);
+                pl::detail::checkpoint();
+                action();
+            }
+            const std::type_info& sourceType() const override { return prevValue->sourceType(); }
             
             void execute() override { 
                 if (!executed) {
                     prev->execute();  
+                    pl::detail::checkpoint();
                     action();      
                     executed = true;
                 }
@@ -227,53 +897,2795 @@ Pipeline<T> make_pipeline(T value, bool immediate = false) {
 
 struct SizeWrapper {
     template<typename T>
-    auto operator()(const T& container) const {
+    constexpr auto operator()(const T& container) const {
         return std::size(container);
     }
 };
 
 SizeWrapper pipeline_size;
 
-template<typename T, typename F>
-auto operator|(T&& value, F&& func) {
-    return make_pipeline(std::forward<T>(value), false) | std::forward<F>(func);
-}
+template<typename T>
+struct is_pipeline : std::false_type {};
 
-int main() {
-    std::cout << "=== Test 1: Basic string pipeline ===" << std::endl;
-    std::string str = "Hello World!";
-    auto pipeline = str | pipeline_size 
-                   | [](auto x){return x * 2;} 
-                   | [](auto x){std::cout << "Result: " << x << std::endl;};
-    pipeline();
+template<typename T>
+struct is_pipeline<Pipeline<T>> : std::true_type {};
 
-    std::cout << "\n=== Test 2: Immediate execution ===" << std::endl;
-    auto result2 = make_pipeline(std::string("Hello"), true) 
-                  | pipeline_size 
-                  | [](auto x){return x * 3;} 
-                  | [](auto x){std::cout << "Immediate: " << x << std::endl;};
+namespace pl {
 
-    std::cout << "\n=== Test 3: Number pipeline ===" << std::endl;
-    auto numberPipeline = 5 | [](auto x){return x + 10;} 
-                          | [](auto x){return x * x;} 
-                          | [](auto x){std::cout << "Square: " << x << std::endl;};
-    numberPipeline();
+// Пайплайн, последний шаг которого - ещё не материализованное выражение.
+// Следующее выражение (или each(...) при поэлементном режиме) не добавляет
+// шаг, а подставляется в текущее; любой другой шаг сначала материализует его.
+template<typename T, typename E, bool Elementwise>
+class ExprPipeline {
+private:
+    Pipeline<T> base;
+    E expr;
 
-    std::cout << "\n=== Test 4: Complex pipeline ===" << std::endl;
-    auto complexPipeline = std::string("Test") 
-                          | pipeline_size
-                          | [](auto x){return x + 100;} 
-                          | [](auto x){return x / 2;} 
-                          | [](auto x){std::cout << "Final: " << x << std::endl;};
-    complexPipeline();
+public:
+    ExprPipeline(Pipeline<T>&& b, E e) : base(std::move(b)), expr(e) {}
 
-    std::cout << "\n=== Test 5: Step-by-step construction ===" << std::endl;
-    auto intermediate = std::string("Pipeline") | pipeline_size | [](auto x){return x * 10;};
-    auto finalPipeline = intermediate | [](auto x){std::cout << "Step-by-step: " << x << std::endl;};
-    finalPipeline();
+    const E& expression() const { return expr; }
 
-    std::cout << "\n=== Test 6: Multiple terminal operations ===" << std::endl;
-    auto multiTerminal = make_pipeline(42, false) 
+    auto materialize() {
+        if constexpr (Elementwise) {
+            auto folded = fold_for<typename T::value_type>(expr);
+            return std::move(base) | [e = folded](const T& container) { return EachStep<decltype(e)>{e}(container); };
+        } else {
+            return std::move(base) | [e = fold_for<T>(expr)](T x) { return e(x); };
+        }
+    }
+
+    template<typename F>
+    auto operator|(F&& func) {
+        if constexpr (!Elementwise && Expression<F>) {
+            auto combined = then(expr, func);
+            return ExprPipeline<T, decltype(combined), false>(std::move(base), combined);
+        } else if constexpr (Elementwise && is_each_step<std::decay_t<F>>::value) {
+            auto combined = then(expr, func.expr);
+            return ExprPipeline<T, decltype(combined), true>(std::move(base), combined);
+        } else {
+            return materialize() | std::forward<F>(func);
+        }
+    }
+};
+
+} // namespace pl
+
+template<typename T, typename E, bool Elementwise>
+struct is_pipeline<pl::ExprPipeline<T, E, Elementwise>> : std::true_type {};
+
+template<typename T>
+struct is_pipeline<pl::ConstPipeline<T>> : std::true_type {};
+
+template<typename T, typename F>
+    requires (!is_pipeline<std::remove_cvref_t<T>>::value)
+auto operator|(T&& value, F&& func) {
+    return make_pipeline(std::forward<T>(value), false) | std::forward<F>(func);
+}
+
+namespace pl {
+
+// Кольцевой буфер фиксированной ёмкости: хранит последние k элементов потока
+template<typename T>
+class RingBuffer {
+private:
+    std::vector<T> data;
+    size_t head = 0;
+    size_t count = 0;
+
+public:
+    explicit RingBuffer(size_t capacity) : data(capacity) {
+        if (capacity == 0) {
+            throw std::invalid_argument("Window size must be positive");
+        }
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return data.size(); }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == data.size(); }
+
+    const T& front() const { return data[head]; }
+    const T& back() const { return data[(head + count - 1) % data.size()]; }
+    const T& operator[](size_t i) const { return data[(head + i) % data.size()]; }
+
+    void push_back(T value) {
+        data[(head + count) % data.size()] = std::move(value);
+        ++count;
+    }
+
+    void pop_front() {
+        head = (head + 1) % data.size();
+        --count;
+    }
+
+    void pop_back() {
+        --count;
+    }
+};
+
+// Скользящая сумма последних k элементов. Для чисел с плавающей точкой
+// вычитание вышедшего элемента теряет младшие разряды (1e16 + 1 - 1e16 = 0),
+// поэтому сумма ведётся с компенсацией Ноймайера, а раз в k шагов
+// пересчитывается по окну, чтобы остаток погрешности не накапливался.
+template<typename T>
+class SlidingSum {
+private:
+    RingBuffer<T> window;
+    T sum{};
+    T compensation{};
+    size_t since_rebuild = 0;
+
+    void add(const T& x) {
+        if constexpr (std::is_floating_point_v<T>) {
+            T t = sum + x;
+            if (std::abs(sum) >= std::abs(x)) {
+                compensation += (sum - t) + x;
+            } else {
+                compensation += (x - t) + sum;
+            }
+            sum = t;
+        } else {
+            sum += x;
+        }
+    }
+
+public:
+    explicit SlidingSum(size_t k) : window(k) {}
+
+    void push(const T& value) {
+        if (window.full()) {
+            if constexpr (std::is_floating_point_v<T>) {
+                add(-window.front());
+            } else {
+                sum -= window.front();
+            }
+            window.pop_front();
+        }
+        window.push_back(value);
+        add(value);
+        if constexpr (std::is_floating_point_v<T>) {
+            if (++since_rebuild == window.capacity()) {
+                since_rebuild = 0;
+                sum = T{};
+                compensation = T{};
+                for (size_t i = 0; i < window.size(); ++i) {
+                    add(window[i]);
+                }
+            }
+        }
+    }
+
+    bool ready() const { return window.full(); }
+    T value() const { return sum + compensation; }
+};
+
+template<typename T>
+class SlidingMean {
+private:
+    SlidingSum<T> sum;
+    size_t k;
+
+public:
+    explicit SlidingMean(size_t window_size) : sum(window_size), k(window_size) {}
+
+    void push(const T& value) { sum.push(value); }
+    bool ready() const { return sum.ready(); }
+    double value() const { return static_cast<double>(sum.value()) / static_cast<double>(k); }
+};
+
+// Минимум (Compare = std::less) или максимум (std::greater) по окну из k
+// элементов на монотонной очереди: каждый элемент входит и выходит один раз.
+template<typename T, typename Compare>
+class SlidingExtremum {
+private:
+    struct Entry {
+        T value;
+        size_t position;
+    };
+
+    RingBuffer<Entry> candidates;
+    size_t k;
+    size_t pushed = 0;
+    Compare better;
+
+public:
+    explicit SlidingExtremum(size_t window_size) : candidates(window_size), k(window_size) {}
+
+    void push(const T& value) {
+        if (!candidates.empty() && candidates.front().position + k <= pushed) {
+            candidates.pop_front();
+        }
+        while (!candidates.empty() && !better(candidates.back().value, value)) {
+            candidates.pop_back();
+        }
+        candidates.push_back(Entry{value, pushed});
+        ++pushed;
+    }
+
+    bool ready() const { return pushed >= k; }
+    T value() const { return candidates.front().value; }
+};
+
+template<typename T>
+using SlidingMin = SlidingExtremum<T, std::less<T>>;
+
+template<typename T>
+using SlidingMax = SlidingExtremum<T, std::greater<T>>;
+
+// Шаг пайплайна: прогоняет контейнер через агрегатор и собирает значения
+// для каждого полного окна (n - k + 1 значений).
+template<template<typename> class Aggregate>
+class SlidingStep {
+private:
+    size_t k;
+
+public:
+    explicit SlidingStep(size_t window_size) : k(window_size) {}
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        Aggregate<Value> aggregate(k);
+        std::vector<decltype(aggregate.value())> result;
+        size_t n = std::size(container);
+        result.reserve(n >= k ? n - k + 1 : 0);
+        detail::BatchCheck check;
+        for (const auto& elem : container) {
+            check();
+            aggregate.push(elem);
+            if (aggregate.ready()) {
+                result.push_back(aggregate.value());
+            }
+        }
+        return result;
+    }
+};
+
+inline SlidingStep<SlidingSum> sliding_sum(size_t k) { return SlidingStep<SlidingSum>(k); }
+inline SlidingStep<SlidingMean> sliding_mean(size_t k) { return SlidingStep<SlidingMean>(k); }
+inline SlidingStep<SlidingMin> sliding_min(size_t k) { return SlidingStep<SlidingMin>(k); }
+inline SlidingStep<SlidingMax> sliding_max(size_t k) { return SlidingStep<SlidingMax>(k); }
+
+// Непересекающиеся окна по k элементов; последнее окно может быть неполным
+class WindowStep {
+private:
+    size_t k;
+
+public:
+    explicit WindowStep(size_t window_size) : k(window_size) {
+        if (k == 0) {
+            throw std::invalid_argument("Window size must be positive");
+        }
+    }
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        std::vector<std::vector<Value>> result;
+        result.reserve((std::size(container) + k - 1) / k);
+        detail::BatchCheck check;
+        for (const auto& elem : container) {
+            check();
+            if (result.empty() || result.back().size() == k) {
+                result.emplace_back();
+                result.back().reserve(k);
+            }
+            result.back().push_back(elem);
+        }
+        return result;
+    }
+};
+
+inline WindowStep window(size_t k) { return WindowStep(k); }
+
+// Поэлементное преобразование контейнера в вектор
+template<typename F>
+class MapStep {
+private:
+    F fn;
+
+public:
+    explicit MapStep(F f) : fn(std::move(f)) {}
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        auto result = detail::take_buffer<std::vector<std::decay_t<std::invoke_result_t<const F&, const Value&>>>>();
+        result.reserve(std::size(container));
+        detail::BatchCheck check;
+        for (const auto& elem : container) {
+            check();
+            result.push_back(std::invoke(fn, elem));
+        }
+        return result;
+    }
+};
+
+template<typename F>
+MapStep<F> map(F fn) { return MapStep<F>(std::move(fn)); }
+
+// Элементы контейнера, удовлетворяющие предикату, в исходном порядке
+template<typename Predicate>
+class FilterStep {
+private:
+    Predicate pred;
+
+public:
+    explicit FilterStep(Predicate p) : pred(std::move(p)) {}
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        auto result = detail::take_buffer<std::vector<Value>>();
+        detail::BatchCheck check;
+        for (const auto& elem : container) {
+            check();
+            if (std::invoke(pred, elem)) {
+                result.push_back(elem);
+            }
+        }
+        return result;
+    }
+};
+
+template<typename Predicate>
+FilterStep<Predicate> filter(Predicate pred) { return FilterStep<Predicate>(std::move(pred)); }
+
+// Свёртка контейнера слева: op(...op(op(init, x0), x1)..., xn)
+template<typename V, typename Op>
+class ReduceStep {
+private:
+    V init;
+    Op op;
+
+public:
+    ReduceStep(V i, Op o) : init(std::move(i)), op(std::move(o)) {}
+
+    const V& initial() const { return init; }
+
+    // Продолжение свёртки с уже накопленного значения
+    template<typename Container>
+    V accumulate(V acc, const Container& container) const {
+        detail::BatchCheck check;
+        for (const auto& elem : container) {
+            check();
+            acc = std::invoke(op, std::move(acc), elem);
+        }
+        return acc;
+    }
+
+    template<typename Container>
+    V operator()(const Container& container) const {
+        return accumulate(init, container);
+    }
+};
+
+template<typename V, typename Op = std::plus<>>
+ReduceStep<V, Op> reduce(V init, Op op = {}) { return ReduceStep<V, Op>(std::move(init), std::move(op)); }
+
+namespace detail {
+
+// Шаги, для которых f(a ++ b) == f(a) ++ f(b): их можно применять к одной
+// дописанной части входа
+template<typename T>
+struct is_elementwise_step : std::false_type {};
+
+template<typename F>
+struct is_elementwise_step<MapStep<F>> : std::true_type {};
+
+template<typename P>
+struct is_elementwise_step<FilterStep<P>> : std::true_type {};
+
+template<typename E>
+struct is_elementwise_step<EachStep<E>> : std::true_type {};
+
+// pipeline_size в инкрементальном режиме - свёртка подсчётом
+struct CountFold {
+    size_t initial() const { return 0; }
+
+    template<typename Container>
+    size_t accumulate(size_t acc, const Container& container) const { return acc + std::size(container); }
+};
+
+template<typename F>
+auto as_fold(F&& step) {
+    if constexpr (std::is_same_v<std::decay_t<F>, SizeWrapper>) {
+        return CountFold{};
+    } else {
+        return std::forward<F>(step);
+    }
+}
+
+template<typename F>
+constexpr bool is_fold_step = std::is_same_v<std::decay_t<F>, SizeWrapper>;
+
+template<typename V, typename Op>
+constexpr bool is_fold_step<ReduceStep<V, Op>> = true;
+
+template<typename T>
+struct SpanCopy {
+    std::vector<T> operator()(std::span<const T> part) const { return std::vector<T>(part.begin(), part.end()); }
+};
+
+} // namespace detail
+
+template<typename Inner, typename F>
+class IncrementalFinish;
+
+template<typename T, typename Delta, typename Fold>
+class IncrementalFold;
+
+// Инкрементальный пайплайн над вектором, который только дописывается.
+// Поэлементные шаги (map, filter, each) склеиваются в одну функцию Delta и
+// при повторном run() применяются лишь к элементам, добавленным с прошлого
+// запуска; их выход дописывается к сохранённому. Свёртка (reduce,
+// pipeline_size) продолжается с накопленного значения, а остальные шаги
+// применяются к уже готовому результату. Если вектор стал короче, состояние
+// сбрасывается и всё считается заново; изменение уже обработанных элементов
+// не отслеживается.
+template<typename T, typename Delta>
+class IncrementalElements {
+private:
+    const std::vector<T>* source;
+    Delta delta;
+    size_t consumed = 0;
+    using Out = typename std::invoke_result_t<const Delta&, std::span<const T>>::value_type;
+    std::vector<Out> output;
+
+    template<typename, typename, typename>
+    friend class IncrementalFold;
+
+public:
+    IncrementalElements(const std::vector<T>* s, Delta d) : source(s), delta(std::move(d)) {}
+
+    const std::vector<Out>& run() {
+        if (source->size() < consumed) {
+            consumed = 0;
+            output.clear();
+        }
+        auto part = delta(std::span<const T>(source->data() + consumed, source->size() - consumed));
+        output.insert(output.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+        consumed = source->size();
+        return output;
+    }
+
+    const std::vector<Out>& operator()() { return run(); }
+
+    template<typename F>
+    auto operator|(F&& step) {
+        if constexpr (detail::is_elementwise_step<std::decay_t<F>>::value) {
+            if constexpr (std::is_same_v<Delta, detail::SpanCopy<T>>) {
+                return IncrementalElements<T, std::decay_t<F>>(source, std::forward<F>(step));
+            } else {
+                auto composed = [first = std::move(delta), second = std::forward<F>(step)](std::span<const T> part) {
+                    return second(first(part));
+                };
+                return IncrementalElements<T, decltype(composed)>(source, std::move(composed));
+            }
+        } else if constexpr (detail::is_fold_step<std::decay_t<F>>) {
+            return IncrementalFold<T, Delta, decltype(detail::as_fold(std::forward<F>(step)))>(
+                std::move(*this), detail::as_fold(std::forward<F>(step)));
+        } else {
+            return IncrementalFinish<IncrementalElements, std::decay_t<F>>(std::move(*this), std::forward<F>(step));
+        }
+    }
+};
+
+// Свёртка поэлементной части, продолжаемая с накопленного значения
+template<typename T, typename Delta, typename Fold>
+class IncrementalFold {
+private:
+    IncrementalElements<T, Delta> elements;
+    Fold fold;
+    std::decay_t<decltype(std::declval<const Fold&>().initial())> acc;
+
+public:
+    IncrementalFold(IncrementalElements<T, Delta>&& e, Fold f) : elements(std::move(e)), fold(std::move(f)), acc(fold.initial()) {}
+
+    const auto& run() {
+        if (elements.source->size() < elements.consumed) {
+            elements.consumed = 0;
+            acc = fold.initial();
+        }
+        auto part = elements.delta(std::span<const T>(elements.source->data() + elements.consumed,
+                                                      elements.source->size() - elements.consumed));
+        acc = fold.accumulate(std::move(acc), part);
+        elements.consumed = elements.source->size();
+        return acc;
+    }
+
+    const auto& operator()() { return run(); }
+
+    template<typename F>
+    auto operator|(F&& step) {
+        return IncrementalFinish<IncrementalFold, std::decay_t<F>>(std::move(*this), std::forward<F>(step));
+    }
+};
+
+// Шаг, применяемый к готовому инкрементальному результату целиком
+template<typename Inner, typename F>
+class IncrementalFinish {
+private:
+    Inner inner;
+    F func;
+
+public:
+    IncrementalFinish(Inner&& i, F f) : inner(std::move(i)), func(std::move(f)) {}
+
+    decltype(auto) run() { return func(inner.run()); }
+
+    decltype(auto) operator()() { return run(); }
+
+    template<typename G>
+    auto operator|(G&& step) {
+        return IncrementalFinish<IncrementalFinish, std::decay_t<G>>(std::move(*this), std::forward<G>(step));
+    }
+};
+
+template<typename T>
+IncrementalElements<T, detail::SpanCopy<T>> incremental(const std::vector<T>& source) {
+    return IncrementalElements<T, detail::SpanCopy<T>>(&source, detail::SpanCopy<T>{});
+}
+
+template<typename T>
+IncrementalElements<T, detail::SpanCopy<T>> incremental(const std::vector<T>&& source) = delete;
+
+} // namespace pl
+
+template<typename T, typename Delta>
+struct is_pipeline<pl::IncrementalElements<T, Delta>> : std::true_type {};
+
+template<typename T, typename Delta, typename Fold>
+struct is_pipeline<pl::IncrementalFold<T, Delta, Fold>> : std::true_type {};
+
+template<typename Inner, typename F>
+struct is_pipeline<pl::IncrementalFinish<Inner, F>> : std::true_type {};
+
+namespace pl {
+
+// Текстовые шаги возвращают std::string_view на исходный буфер и не
+// создают строк для отдельных токенов. Вход принимается только как
+// std::string_view: владеющую строку пайплайн передаёт по значению, и
+// представления указывали бы на уничтоженную копию, поэтому такой вызов
+// запрещён. Буфер, на который смотрит вход, должен пережить результат.
+namespace detail {
+
+template<typename S>
+concept OwningString = std::same_as<std::remove_cvref_t<S>, std::string>;
+
+} // namespace detail
+
+class SplitStep {
+private:
+    std::string delimiter;
+
+    size_t find(std::string_view text, size_t from) const {
+        // У пустого представления data() может быть nullptr, а memchr от
+        // nullptr - неопределённое поведение даже при нулевой длине
+        if (from >= text.size()) {
+            return std::string_view::npos;
+        }
+        if (delimiter.size() == 1) {
+            const void* hit = std::memchr(text.data() + from, delimiter[0], text.size() - from);
+            return hit ? static_cast<const char*>(hit) - text.data() : std::string_view::npos;
+        }
+        return text.find(delimiter, from);
+    }
+
+public:
+    explicit SplitStep(std::string d) : delimiter(std::move(d)) {
+        if (delimiter.empty()) {
+            throw std::invalid_argument("Split delimiter must not be empty");
+        }
+    }
+
+    std::vector<std::string_view> operator()(std::string_view text) const {
+        auto result = detail::take_buffer<std::vector<std::string_view>>();
+        detail::BatchCheck check;
+        size_t begin = 0;
+        while (true) {
+            check();
+            size_t end = find(text, begin);
+            if (end == std::string_view::npos) {
+                result.push_back(text.substr(begin));
+                return result;
+            }
+            result.push_back(text.substr(begin, end - begin));
+            begin = end + delimiter.size();
+        }
+    }
+
+    template<detail::OwningString S>
+    void operator()(S&&) const = delete;
+};
+
+inline SplitStep split(char delim) { return SplitStep(std::string(1, delim)); }
+inline SplitStep split(std::string delim) { return SplitStep(std::move(delim)); }
+
+// Строки без завершающих '\n' и '\r'; перевод строки в конце текста не
+// порождает пустую последнюю строку
+struct LinesStep {
+    std::vector<std::string_view> operator()(std::string_view text) const {
+        auto result = detail::take_buffer<std::vector<std::string_view>>();
+        detail::BatchCheck check;
+        const char* pos = text.data();
+        const char* end = pos + text.size();
+        while (pos != end) {
+            check();
+            const char* eol = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+            const char* next = eol ? eol + 1 : end;
+            const char* last = eol ? eol : end;
+            if (last != pos && last[-1] == '\r') {
+                --last;
+            }
+            result.emplace_back(pos, last - pos);
+            pos = next;
+        }
+        return result;
+    }
+
+    template<detail::OwningString S>
+    void operator()(S&&) const = delete;
+};
+
+inline constexpr LinesStep lines{};
+
+// Непустые фрагменты между символами-разделителями
+class TokenizeStep {
+private:
+    std::array<bool, 256> separator{};
+
+public:
+    explicit TokenizeStep(std::string_view separators) {
+        for (char c : separators) {
+            separator[static_cast<unsigned char>(c)] = true;
+        }
+    }
+
+    std::vector<std::string_view> operator()(std::string_view text) const {
+        auto result = detail::take_buffer<std::vector<std::string_view>>();
+        detail::BatchCheck check;
+        size_t i = 0;
+        while (i < text.size()) {
+            check();
+            while (i < text.size() && separator[static_cast<unsigned char>(text[i])]) {
+                ++i;
+            }
+            size_t begin = i;
+            while (i < text.size() && !separator[static_cast<unsigned char>(text[i])]) {
+                ++i;
+            }
+            if (i > begin) {
+                result.push_back(text.substr(begin, i - begin));
+            }
+        }
+        return result;
+    }
+
+    template<detail::OwningString S>
+    void operator()(S&&) const = delete;
+};
+
+inline TokenizeStep tokenize(std::string_view separators = " \t\r\n\v\f") { return TokenizeStep(separators); }
+
+// Разбор каждого токена целиком через std::from_chars
+template<typename Number>
+class ParseStep {
+public:
+    template<typename Container>
+    std::vector<Number> operator()(const Container& tokens) const {
+        auto result = detail::take_buffer<std::vector<Number>>();
+        result.reserve(std::size(tokens));
+        detail::BatchCheck check;
+        for (std::string_view token : tokens) {
+            check();
+            Number value{};
+            const char* end = token.data() + token.size();
+            auto [ptr, ec] = std::from_chars(token.data(), end, value);
+            if (ec != std::errc{} || ptr != end) {
+                throw std::invalid_argument("Cannot parse number: " + std::string(token));
+            }
+            result.push_back(value);
+        }
+        return result;
+    }
+};
+
+template<typename Number = int>
+ParseStep<Number> parse_int() {
+    static_assert(std::is_integral_v<Number>, "parse_int requires an integral type");
+    return {};
+}
+
+inline ParseStep<double> parse_double() { return {}; }
+
+namespace detail {
+
+inline constexpr char columnar_magic[8] = {'P', 'L', 'C', 'O', 'L', '0', '0', '1'};
+inline constexpr uint64_t columnar_alignment = 64;
+
+struct ColumnEntry {
+    uint32_t kind;
+    uint32_t width;
+    uint64_t offset;
+};
+
+template<typename T>
+constexpr uint32_t column_kind() {
+    return std::is_floating_point_v<T> ? 2 : std::is_signed_v<T> ? 1 : 0;
+}
+
+template<typename Record>
+constexpr size_t record_width() {
+    if constexpr (std::is_arithmetic_v<Record>) {
+        return 1;
+    } else {
+        return std::tuple_size_v<Record>;
+    }
+}
+
+template<size_t I, typename Record>
+const auto& record_field(const Record& record) {
+    if constexpr (std::is_arithmetic_v<Record>) {
+        return record;
+    } else {
+        return std::get<I>(record);
+    }
+}
+
+} // namespace detail
+
+// Колоночный файл: заголовок, столбцы, выровненные по 64 байтам, и индекс в
+// конце (тип, ширина и смещение каждого столбца, число строк и столбцов).
+// Числа хранятся в порядке байт машины, записавшей файл. Записи - числа или
+// tuple/pair/array из чисел. Файл сначала пишется во временный файл с
+// уникальным именем в том же каталоге и затем переименовывается, поэтому
+// читатели не видят его недописанным, а одновременные записи не смешиваются:
+// остаётся файл последней из них.
+class WriteColumnarStep {
+private:
+    std::string path;
+
+    template<typename Record, size_t I, typename Container>
+    static void write_column(std::ofstream& out, const Container& records, uint64_t& pos,
+                             std::vector<detail::ColumnEntry>& entries) {
+        using Field = std::decay_t<decltype(detail::record_field<I>(std::declval<const Record&>()))>;
+        static_assert(std::is_arithmetic_v<Field> && !std::is_same_v<Field, bool>,
+                      "Columnar records may only contain numeric fields");
+        std::vector<Field> column;
+        column.reserve(std::size(records));
+        for (const auto& record : records) {
+            column.push_back(detail::record_field<I>(record));
+        }
+        static const char zeros[detail::columnar_alignment] = {};
+        uint64_t padding = (detail::columnar_alignment - pos % detail::columnar_alignment) % detail::columnar_alignment;
+        out.write(zeros, static_cast<std::streamsize>(padding));
+        pos += padding;
+        entries.push_back({detail::column_kind<Field>(), sizeof(Field), pos});
+        out.write(reinterpret_cast<const char*>(column.data()), static_cast<std::streamsize>(column.size() * sizeof(Field)));
+        pos += column.size() * sizeof(Field);
+    }
+
+    template<typename Record, typename Container, size_t... I>
+    void write(const Container& records, std::index_sequence<I...>) const {
+        // Своё уникальное имя у каждого писателя; O_EXCL не даёт открыть чужой
+        // файл, а права 0644 ограничиваются umask, как у обычного файла
+        static std::atomic<uint64_t> counter{0};
+        std::string temporary;
+        int fd = -1;
+        while (fd < 0) {
+            temporary = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter.fetch_add(1));
+            fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0 && errno != EEXIST) {
+                throw std::runtime_error("Cannot create a temporary file for " + path + ": " + std::strerror(errno));
+            }
+        }
+        close(fd);
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Cannot open " + temporary);
+        }
+        out.write(detail::columnar_magic, sizeof(detail::columnar_magic));
+        uint64_t pos = sizeof(detail::columnar_magic);
+        std::vector<detail::ColumnEntry> entries;
+        (write_column<Record, I>(out, records, pos, entries), ...);
+        static const char zeros[8] = {};
+        out.write(zeros, static_cast<std::streamsize>((8 - pos % 8) % 8));
+        uint64_t tail[2] = {static_cast<uint64_t>(std::size(records)), entries.size()};
+        out.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(detail::ColumnEntry)));
+        out.write(reinterpret_cast<const char*>(tail), sizeof(tail));
+        out.write(detail::columnar_magic, sizeof(detail::columnar_magic));
+        out.close();
+        if (!out || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            throw std::runtime_error("Cannot write " + path);
+        }
+    }
+
+public:
+    explicit WriteColumnarStep(std::string p) : path(std::move(p)) {}
+
+    // Пропускает записи дальше без изменений
+    template<typename Container>
+    Container operator()(const Container& records) const {
+        using Record = typename Container::value_type;
+        write<Record>(records, std::make_index_sequence<detail::record_width<Record>()>{});
+        return records;
+    }
+};
+
+inline WriteColumnarStep write_columnar(std::string path) { return WriteColumnarStep(std::move(path)); }
+
+// Файл, отображённый в память только для чтения. Числовые столбцы
+// возвращаются как std::span прямо на страницы файла, без разбора и копий.
+// Копии объекта разделяют одно отображение.
+class ColumnarFile {
+private:
+    struct Mapping {
+        const char* data = nullptr;
+        size_t size = 0;
+        ~Mapping() {
+            if (data) {
+                munmap(const_cast<char*>(data), size);
+            }
+        }
+    };
+
+    std::shared_ptr<const Mapping> mapping;
+    std::vector<detail::ColumnEntry> entries;
+    uint64_t row_count = 0;
+
+    template<size_t... I, typename... Ts>
+    std::tuple<Ts...> record(size_t row, const std::tuple<std::span<const Ts>...>& spans, std::index_sequence<I...>) const {
+        return std::tuple<Ts...>(std::get<I>(spans)[row]...);
+    }
+
+public:
+    ColumnarFile() = default;
+
+    explicit ColumnarFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        struct stat st {};
+        auto owned = std::make_shared<Mapping>();
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED) {
+                owned->data = static_cast<const char*>(data);
+                owned->size = static_cast<size_t>(st.st_size);
+            }
+        }
+        close(fd);
+        mapping = owned;
+
+        constexpr size_t magic_size = sizeof(detail::columnar_magic);
+        const size_t size = owned->size;
+        if (size < 2 * magic_size + 16
+            || std::memcmp(owned->data, detail::columnar_magic, magic_size) != 0
+            || std::memcmp(owned->data + size - magic_size, detail::columnar_magic, magic_size) != 0) {
+            throw std::runtime_error("Not a columnar file: " + path);
+        }
+        uint64_t tail[2];
+        std::memcpy(tail, owned->data + size - magic_size - sizeof(tail), sizeof(tail));
+        row_count = tail[0];
+        const uint64_t footer_room = size - 2 * magic_size - sizeof(tail);
+        if (tail[1] > footer_room / sizeof(detail::ColumnEntry)) {
+            throw std::runtime_error("Corrupted columnar index: " + path);
+        }
+        const uint64_t index_start = size - magic_size - sizeof(tail) - tail[1] * sizeof(detail::ColumnEntry);
+        entries.resize(tail[1]);
+        std::memcpy(entries.data(), owned->data + index_start, entries.size() * sizeof(detail::ColumnEntry));
+        for (const auto& entry : entries) {
+            if (entry.offset % detail::columnar_alignment != 0 || entry.width == 0
+                || entry.offset > index_start || row_count > (index_start - entry.offset) / entry.width) {
+                throw std::runtime_error("Corrupted columnar index: " + path);
+            }
+        }
+    }
+
+    size_t rows() const { return row_count; }
+    size_t columns() const { return entries.size(); }
+
+    template<typename T>
+    std::span<const T> column(size_t i) const {
+        static_assert(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>, "Columns are numeric");
+        if (i >= entries.size()) {
+            throw std::out_of_range("Column index out of range");
+        }
+        if (entries[i].kind != detail::column_kind<T>() || entries[i].width != sizeof(T)) {
+            throw std::invalid_argument("Column type mismatch");
+        }
+        return std::span<const T>(reinterpret_cast<const T*>(mapping->data + entries[i].offset), row_count);
+    }
+
+    // Сборка записей обратно из столбцов 0..sizeof...(Ts)-1
+    template<typename... Ts>
+    std::vector<std::tuple<Ts...>> records() const {
+        if (sizeof...(Ts) != entries.size()) {
+            throw std::invalid_argument("Column count mismatch");
+        }
+        auto spans = [this]<size_t... I>(std::index_sequence<I...>) {
+            return std::make_tuple(column<Ts>(I)...);
+        }(std::index_sequence_for<Ts...>{});
+        std::vector<std::tuple<Ts...>> result;
+        result.reserve(row_count);
+        detail::BatchCheck check;
+        for (size_t row = 0; row < row_count; ++row) {
+            check();
+            result.push_back(record(row, spans, std::index_sequence_for<Ts...>{}));
+        }
+        return result;
+    }
+};
+
+// Шаги чтения колоночного файла. Файл открывается при каждом вычислении, а
+// не при сборке, поэтому повторный запуск видит файл, заменённый с тех пор.
+// ReadColumnarStep читает заданный путь и не смотрит на вход,
+// ReadColumnarInputStep берёт путь из входа.
+class ReadColumnarStep {
+private:
+    std::string path;
+
+public:
+    explicit ReadColumnarStep(std::string p) : path(std::move(p)) {}
+
+    template<typename Input>
+    ColumnarFile operator()(const Input&) const {
+        return ColumnarFile(path);
+    }
+};
+
+class ReadColumnarInputStep {
+public:
+    template<typename Input>
+    ColumnarFile operator()(const Input& input) const {
+        static_assert(std::is_constructible_v<std::string, const Input&>,
+                      "read_columnar() without a path expects the path as input");
+        return ColumnarFile(std::string(input));
+    }
+};
+
+inline ReadColumnarInputStep read_columnar() { return ReadColumnarInputStep(); }
+inline ReadColumnarStep read_columnar(std::string path) { return ReadColumnarStep(std::move(path)); }
+
+namespace detail {
+
+inline std::atomic<bool> numa_aware{true};
+
+} // namespace detail
+
+// Включает или выключает привязку рабочих потоков параллельных шагов к узлам
+// NUMA; на машине с одним узлом привязки нет в любом случае
+inline void set_numa_aware(bool enabled) { detail::numa_aware.store(enabled); }
+
+// Узлы NUMA и их процессоры по данным /sys/devices/system/node. Если
+// sysfs недоступен, вся машина считается одним узлом.
+class NumaTopology {
+private:
+    std::vector<int> ids;
+    std::vector<std::vector<int>> node_cpus;
+
+    static std::vector<int> parse_cpu_list(const std::string& list) {
+        std::vector<int> cpus;
+        std::stringstream stream(list);
+        std::string range;
+        while (std::getline(stream, range, ',')) {
+            if (range.empty() || range == "\n") {
+                continue;
+            }
+            int first = 0, last = 0;
+            char dash = 0;
+            std::stringstream parts(range);
+            parts >> first;
+            if (parts >> dash >> last && dash == '-') {
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            } else {
+                cpus.push_back(first);
+            }
+        }
+        return cpus;
+    }
+
+public:
+    NumaTopology() {
+        std::error_code error;
+        const std::filesystem::path root = "/sys/devices/system/node";
+        std::vector<std::pair<int, std::vector<int>>> found;
+        for (const auto& entry : std::filesystem::directory_iterator(root, error)) {
+            std::string name = entry.path().filename().string();
+            if (name.rfind("node", 0) != 0 || name.size() == 4
+                || !std::all_of(name.begin() + 4, name.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+                continue;
+            }
+            std::ifstream file(entry.path() / "cpulist");
+            std::string list;
+            if (std::getline(file, list)) {
+                auto cpus = parse_cpu_list(list);
+                if (!cpus.empty()) {
+                    found.emplace_back(std::stoi(name.substr(4)), std::move(cpus));
+                }
+            }
+        }
+        std::sort(found.begin(), found.end());
+        for (auto& [id, cpus] : found) {
+            ids.push_back(id);
+            node_cpus.push_back(std::move(cpus));
+        }
+        if (ids.empty()) {
+            ids.push_back(0);
+            node_cpus.emplace_back();
+        }
+    }
+
+    static const NumaTopology& system() {
+        static const NumaTopology topology;
+        return topology;
+    }
+
+    size_t nodes() const { return ids.size(); }
+    int id(size_t node) const { return ids[node]; }
+    const std::vector<int>& cpus(size_t node) const { return node_cpus[node]; }
+
+    static uintptr_t page_size() {
+        static const uintptr_t size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        return size;
+    }
+
+    // Номера узлов (индексы, а не id ядра) для страниц, покрывающих
+    // [p, p + bytes), начиная со страницы, где лежит p; -1 там, где страница
+    // ещё не выделена или ядро не сообщает узел
+    std::vector<int> nodes_of(const void* p, size_t bytes) const {
+        uintptr_t first = reinterpret_cast<uintptr_t>(p) & ~(page_size() - 1);
+        uintptr_t last = reinterpret_cast<uintptr_t>(p) + std::max<size_t>(bytes, 1);
+        std::vector<void*> pages;
+        for (uintptr_t page = first; page < last; page += page_size()) {
+            pages.push_back(reinterpret_cast<void*>(page));
+        }
+        std::vector<int> status(pages.size(), -1);
+        if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0) {
+            std::fill(status.begin(), status.end(), -1);
+        }
+        for (int& node : status) {
+            auto it = std::find(ids.begin(), ids.end(), node);
+            node = node < 0 || it == ids.end() ? -1 : static_cast<int>(it - ids.begin());
+        }
+        return status;
+    }
+
+    int node_of(const void* p) const {
+        return nodes_of(p, 1).front();
+    }
+};
+
+namespace detail {
+
+// Где лежит вход: начало и шаг элемента, если контейнер непрерывный
+struct Placement {
+    const void* base = nullptr;
+    size_t stride = 0;
+};
+
+template<typename Container>
+Placement placement_of(const Container& container) {
+    if constexpr (std::contiguous_iterator<decltype(std::begin(container))>) {
+        return {std::to_address(std::begin(container)), sizeof(*std::begin(container))};
+    } else {
+        return {};
+    }
+}
+
+// Привязывает текущий поток к процессорам узла и возвращает прежнюю маску в деструкторе
+class NodeBinding {
+private:
+    cpu_set_t saved;
+    bool bound = false;
+
+public:
+    explicit NodeBinding(size_t node) {
+        const auto& cpus = NumaTopology::system().cpus(node);
+        if (cpus.empty() || pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) != 0) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            if (cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        bound = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+    ~NodeBinding() {
+        if (bound) {
+            pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+        }
+    }
+    NodeBinding(const NodeBinding&) = delete;
+    NodeBinding& operator=(const NodeBinding&) = delete;
+};
+
+// Отрезок входа [begin, end), все страницы которого лежат на узле node
+struct NodeRange {
+    size_t begin;
+    size_t end;
+    int node;
+};
+
+// Отрезки входа по узлам его страниц; границы проходят по границам страниц
+inline std::vector<NodeRange> node_ranges(size_t n, Placement placement) {
+    if (n == 0 || !placement.base) {
+        return {{0, n, -1}};
+    }
+    const auto& topology = NumaTopology::system();
+    auto base = reinterpret_cast<uintptr_t>(placement.base);
+    auto pages = topology.nodes_of(placement.base, n * placement.stride);
+    uintptr_t first_page = base & ~(NumaTopology::page_size() - 1);
+    std::vector<NodeRange> ranges;
+    for (size_t p = 0; p < pages.size(); ++p) {
+        // Первый элемент, начинающийся на странице p или позже
+        uintptr_t page = first_page + p * NumaTopology::page_size();
+        size_t begin = page <= base ? 0 : std::min(n, (page - base + placement.stride - 1) / placement.stride);
+        if (ranges.empty()) {
+            ranges.push_back({0, n, pages[p]});
+        } else if (pages[p] != ranges.back().node && begin > ranges.back().begin && begin < n) {
+            ranges.back().end = begin;
+            ranges.push_back({begin, n, pages[p]});
+        }
+    }
+    return ranges;
+}
+
+// Границы частей и узел каждой части (-1 - узел неизвестен)
+struct ChunkPlan {
+    std::vector<size_t> bounds;
+    std::vector<int> nodes;
+
+    size_t chunks() const { return nodes.size(); }
+};
+
+// Делит [0, n) на chunks частей так, чтобы ни одна не пересекала границу
+// отрезков ranges: каждому отрезку достаётся хотя бы одна часть, остальные
+// части по одной отдаются отрезку с наибольшей нагрузкой на часть. Если
+// отрезков больше, чем частей (например, страницы чередуются по узлам),
+// вход делится поровну, а узлом части считается узел её начала.
+inline ChunkPlan plan_chunks(size_t n, size_t chunks, const std::vector<NodeRange>& ranges) {
+    ChunkPlan plan;
+    if (ranges.size() > chunks) {
+        size_t r = 0;
+        for (size_t c = 0; c < chunks; ++c) {
+            size_t begin = n * c / chunks;
+            while (r + 1 < ranges.size() && ranges[r].end <= begin) {
+                ++r;
+            }
+            plan.bounds.push_back(begin);
+            plan.nodes.push_back(ranges[r].node);
+        }
+        plan.bounds.push_back(n);
+        return plan;
+    }
+    std::vector<size_t> shares(ranges.size(), 1);
+    for (size_t extra = ranges.size(); extra < chunks; ++extra) {
+        size_t busiest = 0;
+        for (size_t r = 1; r < ranges.size(); ++r) {
+            // Сравнение (end - begin) / shares без деления
+            if ((ranges[r].end - ranges[r].begin) * shares[busiest] > (ranges[busiest].end - ranges[busiest].begin) * shares[r]) {
+                busiest = r;
+            }
+        }
+        ++shares[busiest];
+    }
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        size_t length = ranges[r].end - ranges[r].begin;
+        for (size_t k = 0; k < shares[r]; ++k) {
+            plan.bounds.push_back(ranges[r].begin + length * k / shares[r]);
+            plan.nodes.push_back(ranges[r].node);
+        }
+    }
+    plan.bounds.push_back(n);
+    return plan;
+}
+
+// Разбиение для parallel_chunks: по узлам страниц входа, если привязка
+// включена и узлов несколько, иначе поровну
+inline ChunkPlan plan_chunks(size_t n, size_t chunks, Placement placement = {}) {
+    chunks = std::max<size_t>(1, std::min(chunks, n));
+    bool pin = numa_aware.load(std::memory_order_relaxed) && NumaTopology::system().nodes() > 1;
+    return plan_chunks(n, chunks, pin ? node_ranges(n, placement) : std::vector<NodeRange>{{0, n, -1}});
+}
+
+// Обрабатывает каждую часть плана в своём потоке; первое исключение из
+// рабочих потоков пробрасывается вызывающему. На машине с несколькими
+// узлами NUMA поток части привязывается к её узлу, а части без известного
+// узла распределяются по узлам поровну. Память, которую поток заполняет
+// сам, по умолчанию ядра выделяется на его узле.
+template<typename F>
+void parallel_chunks(const ChunkPlan& plan, F&& fn) {
+    size_t chunks = plan.chunks();
+    if (chunks <= 1) {
+        fn(size_t(0), plan.bounds.front(), plan.bounds.back());
+        return;
+    }
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> errors(chunks);
+    workers.reserve(chunks - 1);
+    ExecutionContext* context = current_context;
+    const auto& topology = NumaTopology::system();
+    const bool pin = numa_aware.load(std::memory_order_relaxed) && topology.nodes() > 1;
+    auto run = [&](size_t c) {
+        ContextScope scope(context);
+        std::optional<NodeBinding> binding;
+        if (pin) {
+            int node = plan.nodes[c];
+            binding.emplace(node >= 0 ? static_cast<size_t>(node) : c * topology.nodes() / chunks);
+        }
+        try {
+            fn(c, plan.bounds[c], plan.bounds[c + 1]);
+        } catch (...) {
+            errors[c] = std::current_exception();
+        }
+    };
+    for (size_t c = 1; c < chunks; ++c) {
+        workers.emplace_back(run, c);
+    }
+    run(0);
+    for (auto& w : workers) {
+        w.join();
+    }
+    // Отмена важнее прочих ошибок: остальные потоки, скорее всего, упали из-за неё же
+    for (auto& e : errors) {
+        if (e) {
+            try {
+                std::rethrow_exception(e);
+            } catch (const PipelineCancelledError&) {
+                throw;
+            } catch (...) {
+            }
+        }
+    }
+    for (auto& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+}
+
+// Делит [0, n) на chunks непрерывных частей, по возможности по узлам NUMA
+// страниц входа (по placement), и обрабатывает их как выше
+template<typename F>
+void parallel_chunks(size_t n, size_t chunks, F&& fn, Placement placement = {}) {
+    if (chunks <= 1 || n < 2) {
+        fn(size_t(0), size_t(0), n);
+        return;
+    }
+    parallel_chunks(plan_chunks(n, chunks, placement), std::forward<F>(fn));
+}
+
+inline uint64_t mix_hash(uint64_t h) {
+    // std::hash для целых - тождественная функция, поэтому биты перемешиваются
+    h += 0x9e3779b97f4a7c15ull;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+// Хеш-таблица с открытой адресацией: пары ключ-значение лежат подряд
+// в порядке добавления, а таблица проб хранит только 32-битные хеш и номер.
+template<typename Key, typename Value>
+class FlatHashMap {
+private:
+    struct Cell {
+        uint32_t hash;
+        uint32_t index;
+    };
+
+    static constexpr uint32_t empty_cell = UINT32_MAX;
+
+    std::vector<std::pair<Key, Value>> items;
+    std::vector<Cell> cells;
+
+    void rehash(size_t capacity) {
+        std::vector<Cell> fresh(capacity, Cell{0, empty_cell});
+        for (const Cell& c : cells) {
+            if (c.index != empty_cell) {
+                size_t pos = c.hash & (capacity - 1);
+                while (fresh[pos].index != empty_cell) {
+                    pos = (pos + 1) & (capacity - 1);
+                }
+                fresh[pos] = c;
+            }
+        }
+        cells.swap(fresh);
+    }
+
+public:
+    explicit FlatHashMap(size_t expected = 16) {
+        size_t capacity = 16;
+        while (capacity < expected * 2) {
+            capacity *= 2;
+        }
+        cells.assign(capacity, Cell{0, empty_cell});
+        items.reserve(expected);
+    }
+
+    // Возвращает значение по ключу; если ключа нет, создаёт его через make()
+    template<typename Make>
+    Value& find_or_insert(const Key& key, Make&& make) {
+        if ((items.size() + 1) * 2 > cells.size()) {
+            rehash(cells.size() * 2);
+        }
+        auto hash = static_cast<uint32_t>(mix_hash(std::hash<Key>()(key)));
+        size_t mask = cells.size() - 1;
+        for (size_t pos = hash & mask;; pos = (pos + 1) & mask) {
+            Cell& c = cells[pos];
+            if (c.index == empty_cell) {
+                // Ячейка заполняется после элемента: если make() или копия
+                // ключа бросит, таблица останется прежней
+                items.emplace_back(key, make());
+                c = Cell{hash, static_cast<uint32_t>(items.size() - 1)};
+                return items.back().second;
+            }
+            if (c.hash == hash && items[c.index].first == key) {
+                return items[c.index].second;
+            }
+        }
+    }
+
+    Value* find(const Key& key) {
+        auto hash = static_cast<uint32_t>(mix_hash(std::hash<Key>()(key)));
+        size_t mask = cells.size() - 1;
+        for (size_t pos = hash & mask; cells[pos].index != empty_cell; pos = (pos + 1) & mask) {
+            if (cells[pos].hash == hash && items[cells[pos].index].first == key) {
+                return &items[cells[pos].index].second;
+            }
+        }
+        return nullptr;
+    }
+
+    size_t size() const { return items.size(); }
+    std::vector<std::pair<Key, Value>>& entries() { return items; }
+};
+
+} // namespace detail
+
+// Агрегаты для group_by: init() создаёт состояние по первому элементу группы,
+// add() добавляет следующий, merge() объединяет частичные результаты потоков.
+struct CountAggregate {
+    template<typename T>
+    size_t init(const T&) const { return 1; }
+    template<typename T>
+    void add(size_t& acc, const T&) const { ++acc; }
+    void merge(size_t& acc, size_t other) const { acc += other; }
+};
+
+template<typename F>
+struct SumAggregate {
+    F fn;
+    template<typename T>
+    auto init(const T& elem) const { return fn(elem); }
+    template<typename Acc, typename T>
+    void add(Acc& acc, const T& elem) const { acc += fn(elem); }
+    template<typename Acc>
+    void merge(Acc& acc, const Acc& other) const { acc += other; }
+};
+
+template<typename F, typename Compare>
+struct ExtremumAggregate {
+    F fn;
+    template<typename T>
+    auto init(const T& elem) const { return fn(elem); }
+    template<typename Acc, typename T>
+    void add(Acc& acc, const T& elem) const { merge(acc, fn(elem)); }
+    template<typename Acc>
+    void merge(Acc& acc, const Acc& other) const {
+        if (Compare()(other, acc)) {
+            acc = other;
+        }
+    }
+};
+
+inline CountAggregate count() { return CountAggregate{}; }
+
+template<typename F>
+SumAggregate<F> sum(F fn) { return SumAggregate<F>{std::move(fn)}; }
+
+template<typename F>
+ExtremumAggregate<F, std::less<>> min_of(F fn) { return ExtremumAggregate<F, std::less<>>{std::move(fn)}; }
+
+template<typename F>
+ExtremumAggregate<F, std::greater<>> max_of(F fn) { return ExtremumAggregate<F, std::greater<>>{std::move(fn)}; }
+
+// Группировка по ключу с агрегатом. Результат - пары (ключ, агрегат) в порядке
+// первого появления ключа. С threads > 1 каждый поток собирает свою таблицу
+// по непрерывному куску входа, затем таблицы сливаются по порядку кусков.
+template<typename KeyFn, typename Aggregate>
+class GroupByStep {
+private:
+    KeyFn key_fn;
+    Aggregate aggregate;
+    size_t threads;
+
+    static constexpr size_t min_items_per_thread = 16384;
+
+public:
+    GroupByStep(KeyFn k, Aggregate a, size_t t) : key_fn(std::move(k)), aggregate(std::move(a)), threads(t) {}
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        using Key = std::decay_t<decltype(key_fn(std::declval<const Value&>()))>;
+        using Acc = std::decay_t<decltype(aggregate.init(std::declval<const Value&>()))>;
+        using Table = detail::FlatHashMap<Key, Acc>;
+
+        auto accumulate = [this](Table& table, auto first, auto last) {
+            detail::BatchCheck check;
+            for (; first != last; ++first) {
+                check();
+                const auto& elem = *first;
+                bool inserted = false;
+                Acc& acc = table.find_or_insert(key_fn(elem), [&] {
+                    inserted = true;
+                    return aggregate.init(elem);
+                });
+                if (!inserted) {
+                    aggregate.add(acc, elem);
+                }
+            }
+        };
+
+        size_t n = std::size(container);
+        size_t chunks = std::min(threads, n / min_items_per_thread);
+        constexpr bool random_access = std::random_access_iterator<decltype(std::begin(container))>;
+        if (!random_access || chunks <= 1) {
+            Table table;
+            accumulate(table, std::begin(container), std::end(container));
+            return std::move(table.entries());
+        }
+
+        // Таблицы создаются в рабочих потоках, чтобы их память была на узле потока
+        std::vector<std::optional<Table>> partial(chunks);
+        detail::parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end) {
+            accumulate(partial[c].emplace(), std::begin(container) + begin, std::begin(container) + end);
+        }, detail::placement_of(container));
+        Table& merged = *partial[0];
+        for (size_t c = 1; c < chunks; ++c) {
+            detail::checkpoint();
+            for (auto& [key, acc] : partial[c]->entries()) {
+                bool inserted = false;
+                Acc& target = merged.find_or_insert(key, [&] {
+                    inserted = true;
+                    return acc;
+                });
+                if (!inserted) {
+                    aggregate.merge(target, acc);
+                }
+            }
+        }
+        return std::move(merged.entries());
+    }
+};
+
+template<typename KeyFn, typename Aggregate>
+GroupByStep<KeyFn, Aggregate> group_by(KeyFn key_fn, Aggregate aggregate, size_t threads = 1) {
+    return GroupByStep<KeyFn, Aggregate>(std::move(key_fn), std::move(aggregate), threads);
+}
+
+// Сортировка. Вектор принимается по значению и сортируется на месте, остальные
+// контейнеры копируются в вектор. С threads > 1 куски сортируются параллельно
+// и затем попарно сливаются. memory_budget ограничивает собственную память
+// сортировки - сортируемый вектор и буфер слияния (до половины входа);
+// вход больше бюджета отвергается до копирования. Сброса на диск нет.
+template<typename Compare>
+class SortStep {
+private:
+    Compare cmp;
+    size_t threads;
+    size_t memory_budget;
+
+    static constexpr size_t min_items_per_thread = 32768;
+
+public:
+    SortStep(Compare c, size_t t, size_t budget = SIZE_MAX) : cmp(std::move(c)), threads(t), memory_budget(budget) {}
+
+    template<typename Container>
+    auto operator()(Container container) const {
+        using Value = typename Container::value_type;
+        size_t n = std::size(container);
+        size_t merge_items = std::min(threads, n / min_items_per_thread) > 1 ? n / 2 : 0;
+        if (n > SIZE_MAX / sizeof(Value) / 2 || (n + merge_items) * sizeof(Value) > memory_budget) {
+            throw std::length_error("Sort input of " + std::to_string(n) + " items exceeds the memory budget of "
+                                    + std::to_string(memory_budget) + " bytes");
+        }
+        std::vector<Value> data;
+        if constexpr (std::is_same_v<Container, std::vector<Value>>) {
+            data = std::move(container);
+        } else {
+            data.assign(std::begin(container), std::end(container));
+        }
+
+        detail::checkpoint(data.size());
+        size_t chunks = std::min(threads, data.size() / min_items_per_thread);
+        if (chunks <= 1) {
+            std::sort(data.begin(), data.end(), cmp);
+            return data;
+        }
+        auto plan = detail::plan_chunks(data.size(), chunks, detail::placement_of(data));
+        const auto& bounds = plan.bounds;
+        detail::parallel_chunks(plan, [&](size_t, size_t begin, size_t end) {
+            std::sort(data.begin() + begin, data.begin() + end, cmp);
+        });
+        for (size_t width = 1; width < chunks; width *= 2) {
+            detail::checkpoint();
+            size_t merges = (chunks + 2 * width - 1) / (2 * width);
+            detail::parallel_chunks(merges, merges, [&](size_t, size_t first, size_t last) {
+                for (size_t m = first; m < last; ++m) {
+                    size_t lo = 2 * width * m;
+                    size_t mid = std::min(lo + width, chunks);
+                    size_t hi = std::min(lo + 2 * width, chunks);
+                    if (mid < hi) {
+                        std::inplace_merge(data.begin() + bounds[lo], data.begin() + bounds[mid],
+                                           data.begin() + bounds[hi], cmp);
+                    }
+                }
+            });
+        }
+        return data;
+    }
+};
+
+template<typename Compare = std::less<>>
+SortStep<Compare> sort(Compare cmp = Compare(), size_t threads = 1, size_t memory_budget = SIZE_MAX) {
+    return SortStep<Compare>(std::move(cmp), threads, memory_budget);
+}
+
+// Первые k элементов в порядке cmp (для std::greater - k наибольших), отсортированные.
+// Кандидаты хранятся в куче размера k; её вершина - порог, который должен
+// превзойти новый элемент. Для арифметических типов вход проверяется блоками:
+// сравнение блока с порогом без ветвлений векторизуется компилятором, и блоки,
+// где нет ни одного кандидата, пропускаются целиком.
+template<typename Compare>
+class TopKStep {
+private:
+    size_t k;
+    Compare cmp;
+
+    static constexpr size_t block_size = 64;
+
+public:
+    TopKStep(size_t count, Compare c) : k(count), cmp(std::move(c)) {}
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        std::vector<Value> heap;
+        if (k == 0) {
+            return heap;
+        }
+        heap.reserve(k);
+
+        auto offer = [&](const Value& elem) {
+            if (heap.size() < k) {
+                heap.push_back(elem);
+                std::push_heap(heap.begin(), heap.end(), cmp);
+            } else if (cmp(elem, heap.front())) {
+                std::pop_heap(heap.begin(), heap.end(), cmp);
+                heap.back() = elem;
+                std::push_heap(heap.begin(), heap.end(), cmp);
+            }
+        };
+
+        auto first = std::begin(container);
+        auto last = std::end(container);
+        if constexpr (std::is_arithmetic_v<Value> && std::contiguous_iterator<decltype(first)>) {
+            const Value* data = std::to_address(first);
+            size_t n = static_cast<size_t>(last - first);
+            size_t i = 0;
+            for (; i < n && heap.size() < k; ++i) {
+                offer(data[i]);
+            }
+            size_t since_check = i;
+            for (; i + block_size <= n; i += block_size) {
+                since_check += block_size;
+                if (since_check >= detail::check_interval) {
+                    detail::checkpoint(since_check);
+                    since_check = 0;
+                }
+                Value threshold = heap.front();
+                bool any = false;
+                for (size_t j = 0; j < block_size; ++j) {
+                    any |= cmp(data[i + j], threshold);
+                }
+                if (any) {
+                    for (size_t j = 0; j < block_size; ++j) {
+                        offer(data[i + j]);
+                    }
+                }
+            }
+            for (; i < n; ++i) {
+                offer(data[i]);
+            }
+        } else {
+            detail::BatchCheck check;
+            for (; first != last; ++first) {
+                check();
+                offer(*first);
+            }
+        }
+        std::sort_heap(heap.begin(), heap.end(), cmp);
+        return heap;
+    }
+};
+
+template<typename Compare = std::less<>>
+TopKStep<Compare> top_k(size_t k, Compare cmp = Compare()) {
+    return TopKStep<Compare>(k, std::move(cmp));
+}
+
+// Точное удаление повторов: первые вхождения в исходном порядке. Ключи
+// хранятся подряд в плотном массиве FlatHashMap, он же становится результатом.
+class DistinctStep {
+public:
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        detail::FlatHashMap<Value, bool> seen;
+        detail::BatchCheck check;
+        for (const auto& elem : container) {
+            check();
+            seen.find_or_insert(elem, [] { return true; });
+        }
+        std::vector<Value> result;
+        result.reserve(seen.size());
+        for (auto& entry : seen.entries()) {
+            result.push_back(std::move(entry.first));
+        }
+        return result;
+    }
+};
+
+inline DistinctStep distinct() { return DistinctStep{}; }
+
+// HyperLogLog: оценка числа различных элементов в памяти 2^precision байт
+class HyperLogLog {
+private:
+    unsigned precision;
+    std::vector<uint8_t> registers;
+
+public:
+    explicit HyperLogLog(unsigned p = 12) : precision(p), registers(size_t(1) << p) {
+        if (p < 4 || p > 18) {
+            throw std::invalid_argument("HyperLogLog precision must be in [4, 18]");
+        }
+    }
+
+    void add_hash(uint64_t h) {
+        size_t idx = h >> (64 - precision);
+        uint64_t rest = (h << precision) | (uint64_t(1) << (precision - 1));
+        auto rank = static_cast<uint8_t>(std::countl_zero(rest) + 1);
+        registers[idx] = std::max(registers[idx], rank);
+    }
+
+    template<typename T>
+    void add(const T& value) {
+        add_hash(detail::mix_hash(std::hash<T>()(value)));
+    }
+
+    // Поэлементный максимум по байтам; компилятор векторизует этот цикл
+    void merge(const HyperLogLog& other) {
+        if (other.precision != precision) {
+            throw std::invalid_argument("Cannot merge HyperLogLog sketches of different precision");
+        }
+        uint8_t* dst = registers.data();
+        const uint8_t* src = other.registers.data();
+        for (size_t i = 0, n = registers.size(); i < n; ++i) {
+            dst[i] = dst[i] < src[i] ? src[i] : dst[i];
+        }
+    }
+
+    double estimate() const {
+        double m = static_cast<double>(registers.size());
+        double sum = 0;
+        size_t zeros = 0;
+        for (uint8_t r : registers) {
+            sum += std::ldexp(1.0, -r);
+            zeros += r == 0;
+        }
+        double alpha = 0.7213 / (1 + 1.079 / m);
+        double e = alpha * m * m / sum;
+        if (e <= 2.5 * m && zeros != 0) {
+            e = m * std::log(m / static_cast<double>(zeros));
+        }
+        return e;
+    }
+};
+
+// Count-min sketch: оценка частоты сверху, память width * depth счётчиков
+template<typename T>
+class CountMinSketch {
+private:
+    size_t width;
+    size_t depth;
+    std::vector<uint64_t> counters;
+
+    size_t cell(uint64_t h, size_t row) const {
+        uint64_t h1 = h & 0xffffffffu;
+        uint64_t h2 = (h >> 32) | 1;
+        return row * width + (h1 + row * h2) % width;
+    }
+
+public:
+    explicit CountMinSketch(size_t w = 2048, size_t d = 4) : width(w), depth(d), counters(w * d) {
+        if (w == 0 || d == 0) {
+            throw std::invalid_argument("Count-min sketch dimensions must be positive");
+        }
+    }
+
+    void add(const T& value, uint64_t times = 1) {
+        uint64_t h = detail::mix_hash(std::hash<T>()(value));
+        for (size_t row = 0; row < depth; ++row) {
+            counters[cell(h, row)] += times;
+        }
+    }
+
+    uint64_t estimate(const T& value) const {
+        uint64_t h = detail::mix_hash(std::hash<T>()(value));
+        uint64_t best = UINT64_MAX;
+        for (size_t row = 0; row < depth; ++row) {
+            best = std::min(best, counters[cell(h, row)]);
+        }
+        return best;
+    }
+
+    void merge(const CountMinSketch& other) {
+        if (other.width != width || other.depth != depth) {
+            throw std::invalid_argument("Cannot merge count-min sketches of different size");
+        }
+        for (size_t i = 0, n = counters.size(); i < n; ++i) {
+            counters[i] += other.counters[i];
+        }
+    }
+};
+
+namespace detail {
+
+// Заполняет скетч по контейнеру; с threads > 1 каждый поток строит свой
+// скетч по куску входа, затем они сливаются через merge().
+template<typename Sketch, typename Container, typename Make>
+Sketch build_sketch(const Container& container, size_t threads, Make make) {
+    constexpr size_t min_items_per_thread = 65536;
+    size_t n = std::size(container);
+    size_t chunks = std::min(threads, n / min_items_per_thread);
+    auto fill = [](Sketch& sketch, auto first, auto last) {
+        BatchCheck check;
+        for (; first != last; ++first) {
+            check();
+            sketch.add(*first);
+        }
+    };
+    if (!std::random_access_iterator<decltype(std::begin(container))> || chunks <= 1) {
+        Sketch sketch = make();
+        fill(sketch, std::begin(container), std::end(container));
+        return sketch;
+    }
+    // Каждый скетч создаётся и обнуляется своим потоком уже после привязки
+    // к узлу, поэтому его страницы выделяются на узле этого потока
+    std::vector<std::optional<Sketch>> partial(chunks);
+    parallel_chunks(n, chunks, [&](size_t c, size_t begin, size_t end) {
+        if constexpr (std::random_access_iterator<decltype(std::begin(container))>) {
+            partial[c].emplace(make());
+            fill(*partial[c], std::begin(container) + begin, std::begin(container) + end);
+        }
+    }, placement_of(container));
+    for (size_t c = 1; c < chunks; ++c) {
+        partial[0]->merge(*partial[c]);
+    }
+    return std::move(*partial[0]);
+}
+
+} // namespace detail
+
+class ApproxDistinctStep {
+private:
+    unsigned precision;
+    size_t threads;
+
+public:
+    ApproxDistinctStep(unsigned p, size_t t) : precision(p), threads(t) {}
+
+    template<typename Container>
+    double operator()(const Container& container) const {
+        unsigned p = precision;
+        return detail::build_sketch<HyperLogLog>(container, threads, [p] { return HyperLogLog(p); }).estimate();
+    }
+};
+
+inline ApproxDistinctStep approx_distinct(unsigned precision = 12, size_t threads = 1) {
+    return ApproxDistinctStep(precision, threads);
+}
+
+// Возвращает скетч, у которого можно спросить оценку частоты любого значения
+class ApproxCountStep {
+private:
+    size_t width;
+    size_t depth;
+    size_t threads;
+
+public:
+    ApproxCountStep(size_t w, size_t d, size_t t) : width(w), depth(d), threads(t) {}
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Sketch = CountMinSketch<typename Container::value_type>;
+        size_t w = width, d = depth;
+        return detail::build_sketch<Sketch>(container, threads, [w, d] { return Sketch(w, d); });
+    }
+};
+
+inline ApproxCountStep approx_count(size_t width = 2048, size_t depth = 4, size_t threads = 1) {
+    return ApproxCountStep(width, depth, threads);
+}
+
+// Генератор SplitMix64 с переходом вперёд за O(1): состояние - счётчик,
+// поэтому поток номер s - это тот же генератор, сдвинутый на s * 2^32 шагов.
+class SplitMix64 {
+private:
+    static constexpr uint64_t gamma = 0x9e3779b97f4a7c15ull;
+    uint64_t state;
+
+public:
+    explicit SplitMix64(uint64_t seed = 0) : state(seed) {}
+
+    uint64_t next() {
+        state += gamma;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    void jump(uint64_t steps) { state += steps * gamma; }
+
+    double uniform() { return static_cast<double>(next() >> 11) * 0x1.0p-53; }
+
+    void generate(double* out, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = uniform();
+        }
+    }
+};
+
+// Фабрики независимых потоков случайных чисел: поток выдаётся на каждый кусок
+// входа, поэтому результат зависит только от seed, а не от числа потоков.
+struct SplitMixStreams {
+    uint64_t seed;
+
+    SplitMix64 operator()(uint64_t stream) const {
+        SplitMix64 rng(seed);
+        rng.jump(stream << 32);
+        return rng;
+    }
+};
+
+// Потоки на SimpleRNG. Его отображение x -> (a*x + c) mod m при 0 < a < 1
+// не допускает перехода вперёд, поэтому каждый поток начинается со своей
+// точки, выведенной из seed и номера потока.
+struct SimpleRNGStreams {
+    double a, c, m;
+    uint64_t seed;
+
+    SimpleRNG operator()(uint64_t stream) const {
+        double start = SplitMixStreams{seed}(stream).uniform() * m;
+        return SimpleRNG(a, c, m, start);
+    }
+};
+
+inline SimpleRNGStreams simple_rng_streams(double a, double c, double m, uint64_t seed) {
+    return SimpleRNGStreams{a, c, m, seed};
+}
+
+namespace detail {
+
+// Случайные числа пачками через generate() и длины пропусков с
+// геометрическим распределением: один вызов генератора на выбранный
+// элемент, а не на каждый элемент входа.
+template<typename Engine>
+class GeometricSkips {
+private:
+    Engine engine;
+    double log_q;
+    std::array<double, 256> buffer;
+    size_t pos = buffer.size();
+
+    double draw() {
+        if (pos == buffer.size()) {
+            engine.generate(buffer.data(), buffer.size());
+            pos = 0;
+        }
+        return 1.0 - buffer[pos++];
+    }
+
+public:
+    GeometricSkips(Engine e, double p) : engine(std::move(e)), log_q(std::log1p(-p)) {}
+
+    // Сколько элементов пропустить до следующего выбранного
+    size_t next_gap() {
+        double gap = std::floor(std::log(draw()) / log_q);
+        return gap >= static_cast<double>(SIZE_MAX / 2) ? SIZE_MAX / 2 : static_cast<size_t>(gap);
+    }
+
+    double uniform() { return 1.0 - draw(); }
+};
+
+// Вход делится на куски фиксированного размера; кусок c использует поток c.
+// Результаты кусков склеиваются по порядку.
+template<typename Result, typename F>
+std::vector<Result> by_fixed_chunks(size_t n, size_t threads, F&& fn) {
+    constexpr size_t chunk_size = 65536;
+    size_t chunks = (n + chunk_size - 1) / chunk_size;
+    std::vector<std::vector<Result>> parts(chunks);
+    parallel_chunks(chunks, std::min(threads, chunks), [&](size_t, size_t first, size_t last) {
+        for (size_t c = first; c < last; ++c) {
+            parts[c] = fn(c, c * chunk_size, std::min(n, (c + 1) * chunk_size));
+        }
+    });
+    std::vector<Result> result;
+    for (auto& part : parts) {
+        result.insert(result.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+    }
+    return result;
+}
+
+inline void check_probability(double p) {
+    if (!(p >= 0.0 && p <= 1.0)) {
+        throw std::invalid_argument("Sampling probability must be in [0, 1]");
+    }
+}
+
+} // namespace detail
+
+// Каждый элемент попадает в выборку независимо с вероятностью p
+template<typename Streams>
+class SampleStep {
+private:
+    double p;
+    Streams streams;
+    size_t threads;
+
+public:
+    SampleStep(double prob, Streams s, size_t t) : p(prob), streams(std::move(s)), threads(t) {
+        detail::check_probability(p);
+    }
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        if constexpr (!std::random_access_iterator<decltype(std::begin(container))>) {
+            return (*this)(std::vector<Value>(std::begin(container), std::end(container)));
+        } else {
+            return pick(std::begin(container), std::size(container));
+        }
+    }
+
+private:
+    template<typename Iterator>
+    auto pick(Iterator data, size_t n) const {
+        using Value = std::iter_value_t<Iterator>;
+        return detail::by_fixed_chunks<Value>(n, threads, [&](size_t c, size_t begin, size_t end) {
+            std::vector<Value> picked;
+            if (p == 0.0) {
+                return picked;
+            }
+            detail::GeometricSkips skips(streams(c), p);
+            picked.reserve(static_cast<size_t>((end - begin) * p * 1.1) + 16);
+            for (size_t i = begin + skips.next_gap(); i < end; i += skips.next_gap() + 1) {
+                picked.push_back(data[i]);
+            }
+            detail::checkpoint(end - begin);
+            return picked;
+        });
+    }
+};
+
+// Маска той же длины, что и вход: 1 - элемент выбран с вероятностью p
+template<typename Streams>
+class BernoulliMaskStep {
+private:
+    double p;
+    Streams streams;
+    size_t threads;
+
+public:
+    BernoulliMaskStep(double prob, Streams s, size_t t) : p(prob), streams(std::move(s)), threads(t) {
+        detail::check_probability(p);
+    }
+
+    template<typename Container>
+    std::vector<uint8_t> operator()(const Container& container) const {
+        return detail::by_fixed_chunks<uint8_t>(std::size(container), threads, [&](size_t c, size_t begin, size_t end) {
+            std::vector<uint8_t> mask(end - begin, 0);
+            if (p == 0.0) {
+                return mask;
+            }
+            detail::GeometricSkips skips(streams(c), p);
+            for (size_t i = skips.next_gap(); i < mask.size(); i += skips.next_gap() + 1) {
+                mask[i] = 1;
+            }
+            detail::checkpoint(end - begin);
+            return mask;
+        });
+    }
+};
+
+// Равномерная выборка ровно k элементов (алгоритм L): после заполнения
+// резервуара случайные числа тратятся только на элементы, которые его меняют.
+template<typename Streams>
+class ReservoirStep {
+private:
+    size_t k;
+    Streams streams;
+
+public:
+    ReservoirStep(size_t count, Streams s) : k(count), streams(std::move(s)) {}
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        std::vector<Value> reservoir;
+        if (k == 0) {
+            return reservoir;
+        }
+        reservoir.reserve(k);
+        auto rng = streams(0);
+        auto it = std::begin(container);
+        auto last = std::end(container);
+        for (; it != last && reservoir.size() < k; ++it) {
+            reservoir.push_back(*it);
+        }
+        auto positive = [&rng] { return 1.0 - rng.uniform(); };
+        double w = std::exp(std::log(positive()) / static_cast<double>(k));
+        while (it != last) {
+            double skip = std::floor(std::log(positive()) / std::log1p(-w));
+            detail::checkpoint();
+            auto steps = skip >= static_cast<double>(PTRDIFF_MAX / 2) ? PTRDIFF_MAX / 2 : static_cast<std::ptrdiff_t>(skip);
+            std::ranges::advance(it, steps, last);
+            if (it == last) {
+                break;
+            }
+            reservoir[static_cast<size_t>(rng.uniform() * static_cast<double>(k)) % k] = *it;
+            ++it;
+            w *= std::exp(std::log(positive()) / static_cast<double>(k));
+        }
+        return reservoir;
+    }
+};
+
+template<typename Streams>
+concept RandomStreams = std::is_invocable_v<const Streams&, uint64_t>;
+
+inline SampleStep<SplitMixStreams> sample(double p, uint64_t seed = 1, size_t threads = 1) {
+    return SampleStep<SplitMixStreams>(p, SplitMixStreams{seed}, threads);
+}
+
+template<RandomStreams Streams>
+SampleStep<Streams> sample(double p, Streams streams, size_t threads = 1) {
+    return SampleStep<Streams>(p, std::move(streams), threads);
+}
+
+inline BernoulliMaskStep<SplitMixStreams> bernoulli_mask(double p, uint64_t seed = 1, size_t threads = 1) {
+    return BernoulliMaskStep<SplitMixStreams>(p, SplitMixStreams{seed}, threads);
+}
+
+template<RandomStreams Streams>
+BernoulliMaskStep<Streams> bernoulli_mask(double p, Streams streams, size_t threads = 1) {
+    return BernoulliMaskStep<Streams>(p, std::move(streams), threads);
+}
+
+inline ReservoirStep<SplitMixStreams> reservoir(size_t k, uint64_t seed = 1) {
+    return ReservoirStep<SplitMixStreams>(k, SplitMixStreams{seed});
+}
+
+template<RandomStreams Streams>
+ReservoirStep<Streams> reservoir(size_t k, Streams streams) {
+    return ReservoirStep<Streams>(k, std::move(streams));
+}
+
+// Статистика одного фильтра: средняя стоимость проверки одного элемента
+// и доля прошедших элементов (скользящие средние по пачкам).
+struct FilterStats {
+    double cost_ns = 0;
+    double pass_rate = 1;
+    size_t evaluated = 0;
+};
+
+// Набор независимых фильтров, объединённых по "и". Порядок применения не
+// влияет на результат, поэтому шаг измеряет стоимость и селективность каждого
+// фильтра и на границах пачек переставляет их по возрастанию
+// cost / (1 - pass_rate): дешёвые и отсекающие много элементов идут первыми.
+// Статистика общая для всех копий шага и сохраняется между запусками.
+template<typename... Predicates>
+class CommutativeFilterStep {
+private:
+    struct Profile {
+        std::mutex mutex;
+        std::vector<FilterStats> stats = std::vector<FilterStats>(sizeof...(Predicates));
+        std::vector<size_t> order;
+        size_t reorders = 0;
+    };
+
+    static constexpr size_t batch_size = 4096;
+    static constexpr double smoothing = 0.2;
+
+    std::tuple<Predicates...> preds;
+    std::shared_ptr<Profile> profile = std::make_shared<Profile>();
+
+    // Применяет фильтр к выбранным номерам и уплотняет список, возвращая число прошедших
+    template<size_t I, typename Value>
+    static size_t apply(const std::tuple<Predicates...>& preds, const Value* data, uint32_t* selection, size_t n) {
+        const auto& pred = std::get<I>(preds);
+        size_t kept = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t idx = selection[i];
+            selection[kept] = idx;
+            kept += std::invoke(pred, data[idx]) ? 1 : 0;
+        }
+        return kept;
+    }
+
+    template<typename Value, size_t... I>
+    static auto make_table(std::index_sequence<I...>) {
+        using Apply = size_t (*)(const std::tuple<Predicates...>&, const Value*, uint32_t*, size_t);
+        return std::array<Apply, sizeof...(Predicates)>{&apply<I, Value>...};
+    }
+
+    static double rank(const FilterStats& s) {
+        double rejected = 1 - s.pass_rate;
+        return rejected <= 0 ? std::numeric_limits<double>::infinity() : s.cost_ns / rejected;
+    }
+
+public:
+    explicit CommutativeFilterStep(Predicates... p) : preds(std::move(p)...) {
+        for (size_t i = 0; i < sizeof...(Predicates); ++i) {
+            profile->order.push_back(i);
+        }
+    }
+
+    // Текущий порядок применения фильтров (номера в порядке объявления)
+    std::vector<size_t> order() const {
+        std::lock_guard<std::mutex> lock(profile->mutex);
+        return profile->order;
+    }
+
+    std::vector<FilterStats> stats() const {
+        std::lock_guard<std::mutex> lock(profile->mutex);
+        return profile->stats;
+    }
+
+    size_t reorders() const {
+        std::lock_guard<std::mutex> lock(profile->mutex);
+        return profile->reorders;
+    }
+
+    template<typename Container>
+    auto operator()(const Container& container) const {
+        using Value = typename Container::value_type;
+        static const auto table = make_table<Value>(std::index_sequence_for<Predicates...>());
+
+        std::vector<Value> copy;
+        const Value* data;
+        size_t n = std::size(container);
+        if constexpr (std::contiguous_iterator<decltype(std::begin(container))>) {
+            data = std::to_address(std::begin(container));
+        } else {
+            copy.assign(std::begin(container), std::end(container));
+            data = copy.data();
+        }
+
+        std::vector<Value> result;
+        std::vector<uint32_t> selection(std::min(n, batch_size));
+        std::vector<size_t> order = this->order();
+        std::vector<double> elapsed(order.size());
+        std::vector<size_t> seen(order.size()), passed(order.size());
+        for (size_t begin = 0; begin < n; begin += batch_size) {
+            size_t count = std::min(batch_size, n - begin);
+            detail::checkpoint(count);
+            for (size_t i = 0; i < count; ++i) {
+                selection[i] = static_cast<uint32_t>(i);
+            }
+            size_t alive = count;
+            for (size_t f : order) {
+                if (alive == 0) {
+                    seen[f] = 0;
+                    continue;
+                }
+                auto start = std::chrono::steady_clock::now();
+                size_t kept = table[f](preds, data + begin, selection.data(), alive);
+                elapsed[f] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+                seen[f] = alive;
+                passed[f] = kept;
+                alive = kept;
+            }
+            for (size_t i = 0; i < alive; ++i) {
+                result.push_back(data[begin + selection[i]]);
+            }
+
+            std::lock_guard<std::mutex> lock(profile->mutex);
+            for (size_t f = 0; f < order.size(); ++f) {
+                if (seen[f] == 0) {
+                    continue;
+                }
+                FilterStats& st = profile->stats[f];
+                double cost = elapsed[f] / static_cast<double>(seen[f]);
+                double rate = static_cast<double>(passed[f]) / static_cast<double>(seen[f]);
+                double w = st.evaluated == 0 ? 1.0 : smoothing;
+                st.cost_ns += w * (cost - st.cost_ns);
+                st.pass_rate += w * (rate - st.pass_rate);
+                st.evaluated += seen[f];
+            }
+            std::vector<size_t> best = profile->order;
+            std::stable_sort(best.begin(), best.end(), [&](size_t a, size_t b) {
+                return rank(profile->stats[a]) < rank(profile->stats[b]);
+            });
+            if (best != profile->order) {
+                profile->order = best;
+                ++profile->reorders;
+            }
+            order = profile->order;
+        }
+        return result;
+    }
+};
+
+template<typename... Predicates>
+CommutativeFilterStep<Predicates...> commutative_filters(Predicates... preds) {
+    return CommutativeFilterStep<Predicates...>(std::move(preds)...);
+}
+
+// Именованное ядро, обрабатывающее пачку элементов за один вызов. Цикл по
+// элементам скомпилирован заранее, а стирание типа стоит один косвенный
+// вызов на пачку. run() пишет не больше n элементов Out в out и возвращает
+// их число; если input == output, out может совпадать с data.
+struct BatchKernel {
+    std::string name;
+    std::type_index input;
+    std::type_index output;
+    std::function<size_t(const void* data, size_t n, void* out)> run;
+    std::function<std::shared_ptr<void>(size_t n)> make_buffer;
+};
+
+class KernelRegistry {
+private:
+    std::unordered_map<std::string, std::shared_ptr<const BatchKernel>> kernels;
+
+    void add(BatchKernel kernel) {
+        auto name = kernel.name;
+        kernels[name] = std::make_shared<const BatchKernel>(std::move(kernel));
+    }
+
+    // Буфер на n элементов; указатель смотрит на данные вектора и владеет им
+    template<typename T>
+    static std::shared_ptr<void> buffer(size_t n) {
+        auto storage = std::make_shared<std::vector<T>>(n);
+        return std::shared_ptr<void>(storage, storage->data());
+    }
+
+public:
+    template<typename In, typename F>
+    void add_map(const std::string& name, F fn) {
+        using Out = std::decay_t<std::invoke_result_t<const F&, const In&>>;
+        add(BatchKernel{
+            name, typeid(In), typeid(Out),
+            [fn = std::move(fn)](const void* data, size_t n, void* out) {
+                auto result = static_cast<Out*>(out);
+                if constexpr (std::is_same_v<In, Out>) {
+                    if (out == data) {
+                        for (size_t i = 0; i < n; ++i) {
+                            result[i] = fn(std::as_const(result[i]));
+                        }
+                        return n;
+                    }
+                }
+                auto input = static_cast<const In*>(data);
+                for (size_t i = 0; i < n; ++i) {
+                    result[i] = fn(input[i]);
+                }
+                return n;
+            },
+            &buffer<Out>});
+    }
+
+    template<typename T, typename Predicate>
+    void add_filter(const std::string& name, Predicate pred) {
+        add(BatchKernel{
+            name, typeid(T), typeid(T),
+            [pred = std::move(pred)](const void* data, size_t n, void* out) {
+                auto input = static_cast<const T*>(data);
+                auto result = static_cast<T*>(out);
+                size_t kept = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    if (pred(input[i])) {
+                        result[kept++] = input[i];
+                    }
+                }
+                return kept;
+            },
+            &buffer<T>});
+    }
+
+    std::shared_ptr<const BatchKernel> find(const std::string& name) const {
+        auto it = kernels.find(name);
+        if (it == kernels.end()) {
+            throw std::invalid_argument("Unknown pipeline kernel: " + name);
+        }
+        return it->second;
+    }
+};
+
+// Пайплайн, собранный во время выполнения из ядер реестра. Совместимость
+// типов соседних ядер проверяется при сборке, а не на каждом элементе.
+class RuntimePipeline {
+private:
+    std::vector<std::shared_ptr<const BatchKernel>> chain;
+
+public:
+    static constexpr size_t default_batch_size = 4096;
+
+    RuntimePipeline(const KernelRegistry& registry, const std::vector<std::string>& names) {
+        if (names.empty()) {
+            throw std::invalid_argument("Runtime pipeline must contain at least one kernel");
+        }
+        for (const auto& name : names) {
+            auto kernel = registry.find(name);
+            if (!chain.empty() && chain.back()->output != kernel->input) {
+                throw std::invalid_argument("Kernel '" + name + "' cannot follow '" + chain.back()->name + "': type mismatch");
+            }
+            chain.push_back(std::move(kernel));
+        }
+    }
+
+    // Конфигурация вида "times3 | plus7 | half"
+    static RuntimePipeline parse(const KernelRegistry& registry, const std::string& spec) {
+        std::vector<std::string> names;
+        std::istringstream in(spec);
+        std::string token;
+        while (std::getline(in, token, '|')) {
+            auto first = token.find_first_not_of(" \t");
+            auto last = token.find_last_not_of(" \t");
+            if (first != std::string::npos) {
+                names.push_back(token.substr(first, last - first + 1));
+            }
+        }
+        return RuntimePipeline(registry, names);
+    }
+
+    // Первое ядро читает вход, последнее пишет сразу в результат. Ядра
+    // между ними с input == output работают на месте, остальным нужен
+    // свой буфер на пачку.
+    template<typename In, typename Out>
+    std::vector<Out> run(const std::vector<In>& input, size_t batch_size = default_batch_size) const {
+        if (chain.front()->input != typeid(In) || chain.back()->output != typeid(Out)) {
+            throw std::invalid_argument("Runtime pipeline input or output type mismatch");
+        }
+        std::vector<std::shared_ptr<void>> buffers(chain.size());
+        for (size_t k = 0; k + 1 < chain.size(); ++k) {
+            if (k == 0 || chain[k]->input != chain[k]->output) {
+                buffers[k] = chain[k]->make_buffer(std::min(batch_size, input.size()));
+            }
+        }
+        std::vector<Out> result;
+        result.reserve(input.size());
+        for (size_t begin = 0; begin < input.size(); begin += batch_size) {
+            size_t n = std::min(batch_size, input.size() - begin);
+            detail::checkpoint(n);
+            const void* data = input.data() + begin;
+            for (size_t k = 0; k + 1 < chain.size(); ++k) {
+                void* out = buffers[k] ? buffers[k].get() : const_cast<void*>(data);
+                n = chain[k]->run(data, n, out);
+                data = out;
+            }
+            size_t written = result.size();
+            result.resize(written + n);
+            result.resize(written + chain.back()->run(data, n, result.data() + written));
+        }
+        return result;
+    }
+
+    // Шаг для обычного Pipeline: vec | runtime.stage<In, Out>()
+    template<typename In, typename Out>
+    auto stage() const {
+        return [self = *this](const std::vector<In>& input) { return self.run<In, Out>(input); };
+    }
+};
+
+enum class JoinStrategy { Auto, Hash, Merge };
+
+// Внутреннее соединение входа с результатом другого пайплайна по ключу.
+// Пары (a, b) выдаются в порядке входа, совпадения из b - в их порядке.
+// Auto выбирает слияние, если обе стороны уже отсортированы по ключу, иначе
+// хеш-соединение: правая сторона индексируется таблицей с цепочками,
+// хранящимися в плоских массивах номеров.
+template<typename Other, typename KeyA, typename KeyB>
+class JoinStep {
+private:
+    std::shared_ptr<const Pipeline<Other>> other;
+    KeyA key_a;
+    KeyB key_b;
+    JoinStrategy strategy;
+
+public:
+    JoinStep(Pipeline<Other>&& o, KeyA ka, KeyB kb, JoinStrategy s)
+        : other(std::make_shared<const Pipeline<Other>>(std::move(o))), key_a(std::move(ka)), key_b(std::move(kb)), strategy(s) {}
+
+    template<typename Container>
+    auto operator()(const Container& left) const {
+        using A = typename Container::value_type;
+        using B = typename Other::value_type;
+        using Key = std::common_type_t<std::decay_t<std::invoke_result_t<const KeyA&, const A&>>,
+                                       std::decay_t<std::invoke_result_t<const KeyB&, const B&>>>;
+        const Other right_container = other->run();
+        std::vector<B> right(std::begin(right_container), std::end(right_container));
+        std::vector<std::pair<A, B>> result;
+
+        bool merge = strategy == JoinStrategy::Merge;
+        if constexpr (std::totally_ordered<Key>) {
+            if (strategy == JoinStrategy::Auto) {
+                auto by_a = [this](const A& x, const A& y) { return Key(key_a(x)) < Key(key_a(y)); };
+                auto by_b = [this](const B& x, const B& y) { return Key(key_b(x)) < Key(key_b(y)); };
+                merge = std::is_sorted(std::begin(left), std::end(left), by_a)
+                     && std::is_sorted(right.begin(), right.end(), by_b);
+            }
+            if (merge) {
+                merge_join(left, right, result);
+                return result;
+            }
+        } else if (merge) {
+            throw std::invalid_argument("Merge join requires ordered keys");
+        }
+        hash_join<Key>(left, right, result);
+        return result;
+    }
+
+private:
+    template<typename Container, typename B, typename Result>
+    void merge_join(const Container& left, const std::vector<B>& right, Result& result) const {
+        size_t j = 0;
+        detail::BatchCheck check;
+        for (const auto& a : left) {
+            check();
+            auto k = key_a(a);
+            while (j < right.size() && key_b(right[j]) < k) {
+                ++j;
+            }
+            for (size_t r = j; r < right.size() && !(k < key_b(right[r])); ++r) {
+                result.emplace_back(a, right[r]);
+            }
+        }
+    }
+
+    template<typename Key, typename Container, typename B, typename Result>
+    void hash_join(const Container& left, const std::vector<B>& right, Result& result) const {
+        // Номера строк правой стороны 32-битные, а UINT32_MAX занят концом цепочки
+        constexpr uint32_t end_of_chain = UINT32_MAX;
+        if (right.size() >= end_of_chain) {
+            throw std::length_error("Hash join build side has too many rows");
+        }
+        detail::FlatHashMap<Key, uint32_t> heads(right.size());
+        std::vector<uint32_t> next(right.size(), end_of_chain);
+        for (size_t i = right.size(); i-- > 0;) {
+            uint32_t& head = heads.find_or_insert(key_b(right[i]), [] { return end_of_chain; });
+            next[i] = head;
+            head = static_cast<uint32_t>(i);
+        }
+        detail::BatchCheck check;
+        for (const auto& a : left) {
+            check();
+            if (const uint32_t* head = heads.find(key_a(a))) {
+                for (uint32_t r = *head; r != end_of_chain; r = next[r]) {
+                    result.emplace_back(a, right[r]);
+                }
+            }
+        }
+    }
+};
+
+template<typename Other, typename KeyA, typename KeyB>
+JoinStep<Other, KeyA, KeyB> join(Pipeline<Other>&& other, KeyA key_a, KeyB key_b,
+                                 JoinStrategy strategy = JoinStrategy::Auto) {
+    return JoinStep<Other, KeyA, KeyB>(std::move(other), std::move(key_a), std::move(key_b), strategy);
+}
+
+struct SchedulerMetrics {
+    size_t queue_depth = 0;
+    size_t submitted = 0;
+    size_t batches = 0;
+    size_t max_batch = 0;
+    double mean_batch = 0;
+};
+
+// Планировщик множества мелких пайплайнов. Пайплайн регистрируется один раз
+// как "форма", после чего в него отправляются только входные значения.
+// Запросы одной формы копятся в очереди и в порядке поступления забираются
+// пачками в массивы входов и обещаний. Пачку выполняет один поток пула:
+// блокировка, пробуждение, поиск последнего шага, проверка типа входа и
+// установка пула буферов оплачиваются один раз на пачку, а шаги пайплайна
+// связаны напрямую, без dynamic_cast при каждом вычислении.
+class Scheduler {
+private:
+    struct Batch {
+        virtual ~Batch() = default;
+        virtual void run() = 0;
+    };
+
+    struct ShapeQueue {
+        bool scheduled = false;
+        virtual ~ShapeQueue() = default;
+        virtual size_t pending() const = 0;
+        virtual std::unique_ptr<Batch> take(size_t limit) = 0;
+    };
+
+    template<typename In, typename Out>
+    struct TypedQueue : ShapeQueue {
+        std::shared_ptr<const Pipeline<Out>> pipeline;
+        std::deque<In> inputs;
+        std::deque<std::promise<Out>> promises;
+
+        struct TypedBatch : Batch {
+            std::shared_ptr<const Pipeline<Out>> pipeline;
+            std::vector<In> inputs;
+            std::vector<std::promise<Out>> promises;
+
+            // Если run_each прервётся, ошибку получают только ещё не выполненные
+            // запросы: повторная установка результата бросила бы future_error
+            void run() override {
+                std::vector<bool> settled(inputs.size());
+                auto failed = [&](size_t i, std::exception_ptr error) {
+                    promises[i].set_exception(error);
+                    settled[i] = true;
+                };
+                try {
+                    if constexpr (std::is_void_v<Out>) {
+                        pipeline->run_each(std::span<const In>(inputs), [&](size_t i) {
+                            promises[i].set_value();
+                            settled[i] = true;
+                        }, failed);
+                    } else {
+                        pipeline->run_each(std::span<const In>(inputs), [&](size_t i, Out&& value) {
+                            promises[i].set_value(std::move(value));
+                            settled[i] = true;
+                        }, failed);
+                    }
+                } catch (...) {
+                    for (size_t i = 0; i < inputs.size(); ++i) {
+                        if (!settled[i]) {
+                            try {
+                                promises[i].set_exception(std::current_exception());
+                            } catch (const std::future_error&) {
+                            }
+                        }
+                    }
+                }
+            }
+        };
+
+        explicit TypedQueue(Pipeline<Out>&& p) : pipeline(std::make_shared<const Pipeline<Out>>(std::move(p))) {}
+
+        size_t pending() const override { return inputs.size(); }
+
+        // Забираем самые старые запросы, чтобы ни один не ждал бесконечно
+        std::unique_ptr<Batch> take(size_t limit) override {
+            auto count = static_cast<std::ptrdiff_t>(std::min(limit, inputs.size()));
+            auto batch = std::make_unique<TypedBatch>();
+            batch->pipeline = pipeline;
+            batch->inputs.assign(std::make_move_iterator(inputs.begin()), std::make_move_iterator(inputs.begin() + count));
+            batch->promises.assign(std::make_move_iterator(promises.begin()), std::make_move_iterator(promises.begin() + count));
+            inputs.erase(inputs.begin(), inputs.begin() + count);
+            promises.erase(promises.begin(), promises.begin() + count);
+            return batch;
+        }
+    };
+
+    std::vector<std::unique_ptr<ShapeQueue>> shapes;
+    std::deque<ShapeQueue*> ready;
+    std::vector<std::thread> workers;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    size_t batch_limit;
+    bool stopping = false;
+    size_t queued = 0;
+    size_t submitted = 0;
+    size_t batches = 0;
+    size_t executed = 0;
+    size_t max_batch = 0;
+
+    void work() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !ready.empty(); });
+            if (ready.empty()) {
+                return;
+            }
+            ShapeQueue* shape = ready.front();
+            ready.pop_front();
+            size_t before = shape->pending();
+            auto batch = shape->take(batch_limit);
+            size_t size = before - shape->pending();
+            queued -= size;
+            executed += size;
+            ++batches;
+            max_batch = std::max(max_batch, size);
+            if (shape->pending() > 0) {
+                ready.push_back(shape);
+                wake.notify_one();
+            } else {
+                shape->scheduled = false;
+            }
+            lock.unlock();
+            batch->run();
+            lock.lock();
+        }
+    }
+
+public:
+    template<typename In, typename Out>
+    class Shape {
+        friend class Scheduler;
+        TypedQueue<In, Out>* queue;
+        explicit Shape(TypedQueue<In, Out>* q) : queue(q) {}
+    };
+
+    explicit Scheduler(size_t threads = std::max(1u, std::thread::hardware_concurrency()), size_t max_batch_size = 1024)
+        : batch_limit(std::max<size_t>(1, max_batch_size)) {
+        for (size_t t = 0; t < std::max<size_t>(1, threads); ++t) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Перед остановкой потоки дорабатывают все принятые запросы
+    ~Scheduler() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    template<typename In, typename Out>
+    Shape<In, Out> add_shape(Pipeline<Out>&& pipeline) {
+        auto queue = std::make_unique<TypedQueue<In, Out>>(std::move(pipeline));
+        auto* raw = queue.get();
+        std::lock_guard lock(mutex);
+        shapes.push_back(std::move(queue));
+        return Shape<In, Out>(raw);
+    }
+
+    template<typename In, typename Out>
+    std::future<Out> submit(const Shape<In, Out>& shape, In input) {
+        std::promise<Out> promise;
+        auto future = promise.get_future();
+        bool notify = false;
+        {
+            std::lock_guard lock(mutex);
+            if (stopping) {
+                throw std::runtime_error("Scheduler is stopping");
+            }
+            shape.queue->inputs.push_back(std::move(input));
+            shape.queue->promises.push_back(std::move(promise));
+            ++queued;
+            ++submitted;
+            if (!shape.queue->scheduled) {
+                shape.queue->scheduled = true;
+                ready.push_back(shape.queue);
+                notify = true;
+            }
+        }
+        if (notify) {
+            wake.notify_one();
+        }
+        return future;
+    }
+
+    SchedulerMetrics metrics() const {
+        std::lock_guard lock(mutex);
+        SchedulerMetrics m;
+        m.queue_depth = queued;
+        m.submitted = submitted;
+        m.batches = batches;
+        m.max_batch = max_batch;
+        m.mean_batch = batches ? static_cast<double>(executed) / batches : 0.0;
+        return m;
+    }
+};
+
+} // namespace pl
+
+#ifdef PIPELINE_COUNT_ALLOCATIONS
+// Подсчёт всех выделений памяти для Test 34:
+// g++ -std=c++20 -DPIPELINE_COUNT_ALLOCATIONS Pipeline.cpp
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+std::atomic<size_t> allocationCount{0};
+
+} // namespace
+
+// GCC не связывает free с заменённым operator new и выдаёт ложное
+// предупреждение о несовпадении, поэтому оно отключено для этих функций.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new(size_t size) {
+    if (void* p = operator new(size, std::nothrow)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return operator new(size, std::nothrow); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+int main() {
+    std::cout << "=== Test 1: Basic string pipeline ===" << std::endl;
+    std::string str = "Hello World!";
+    auto pipeline = str | pipeline_size 
+                   | [](auto x){return x * 2;} 
+                   | [](auto x){std::cout << "Result: " << x << std::endl;};
+    pipeline();
+
+    std::cout << "\n=== Test 2: Immediate execution ===" << std::endl;
+    auto result2 = make_pipeline(std::string("Hello"), true) 
+                  | pipeline_size 
+                  | [](auto x){return x * 3;} 
+                  | [](auto x){std::cout << "Immediate: " << x << std::endl;};
+
+    std::cout << "\n=== Test 3: Number pipeline ===" << std::endl;
+    auto numberPipeline = 5 | [](auto x){return x + 10;} 
+                          | [](auto x){return x * x;} 
+                          | [](auto x){std::cout << "Square: " << x << std::endl;};
+    numberPipeline();
+
+    std::cout << "\n=== Test 4: Complex pipeline ===" << std::endl;
+    auto complexPipeline = std::string("Test") 
+                          | pipeline_size
+                          | [](auto x){return x + 100;} 
+                          | [](auto x){return x / 2;} 
+                          | [](auto x){std::cout << "Final: " << x << std::endl;};
+    complexPipeline();
+
+    std::cout << "\n=== Test 5: Step-by-step construction ===" << std::endl;
+    auto intermediate = std::string("Pipeline") | pipeline_size | [](auto x){return x * 10;};
+    auto finalPipeline = intermediate | [](auto x){std::cout << "Step-by-step: " << x << std::endl;};
+    finalPipeline();
+
+    std::cout << "\n=== Test 6: Multiple terminal operations ===" << std::endl;
+    auto multiTerminal = make_pipeline(42, false) 
                         | [](auto x){std::cout << "First: " << x << std::endl;}
                         | [](){std::cout << "Second operation" << std::endl;};
     multiTerminal();
@@ -354,6 +3766,645 @@ int main() {
         | pipeline_size
         | [](auto x){std::cout << "Vector size: " << x << std::endl;};
 
+    std::cout << "\n=== Test 18: Sliding aggregates ===" << std::endl;
+    std::vector<int> series = {1, 3, 2, 5, 4, 6, 0};
+    auto printAll = [](const std::string& name) {
+        return [name](auto values) {
+            std::cout << name << ":";
+            for (auto v : values) {
+                std::cout << " " << v;
+            }
+            std::cout << std::endl;
+        };
+    };
+    auto sumPipeline = series | pl::sliding_sum(3) | printAll("Sliding sum");
+    sumPipeline();
+    auto meanPipeline = series | pl::sliding_mean(2) | printAll("Sliding mean");
+    meanPipeline();
+    auto preciseSum = std::vector<double>{1e16, 1, 1, 1} | pl::sliding_sum(2)
+                    | [](auto v){ std::cout << "Sliding sum keeps small terms: " << std::boolalpha << (v[1] == 2.0 && v[2] == 2.0) << std::endl; };
+    preciseSum();
+    auto minPipeline = series | pl::sliding_min(3) | printAll("Sliding min");
+    minPipeline();
+    auto maxPipeline = series | pl::sliding_max(3) | printAll("Sliding max");
+    maxPipeline();
+
+    std::cout << "\n=== Test 19: Tumbling windows ===" << std::endl;
+    auto windowPipeline = series | pl::window(3)
+                        | [](auto windows){
+                              for (const auto& w : windows) {
+                                  std::cout << "Window of " << w.size() << ", first " << w.front() << std::endl;
+                              }
+                          };
+    windowPipeline();
+
+    std::cout << "\n=== Test 20: Group by ===" << std::endl;
+    std::vector<std::string> words = {"pipe", "line", "a", "of", "stages", "to", "group"};
+    auto groupPipeline = words
+                       | pl::group_by([](const std::string& w){ return w.size(); }, pl::count())
+                       | [](auto groups){
+                             for (const auto& [len, cnt] : groups) {
+                                 std::cout << "Length " << len << ": " << cnt << std::endl;
+                             }
+                         };
+    groupPipeline();
+
+    std::vector<int> numbers(200000);
+    for (size_t i = 0; i < numbers.size(); ++i) {
+        numbers[i] = static_cast<int>(i * 7919 % 1000);
+    }
+    auto byRemainder = [](int x){ return x % 10; };
+    auto asLong = [](int x){ return static_cast<long long>(x); };
+    std::vector<std::pair<int, long long>> sequentialGroups, parallelGroups;
+    (numbers | pl::group_by(byRemainder, pl::sum(asLong)) | [&](auto g){ sequentialGroups = g; })();
+    (numbers | pl::group_by(byRemainder, pl::sum(asLong), 4) | [&](auto g){ parallelGroups = g; })();
+    std::cout << "Groups: " << parallelGroups.size() << ", parallel matches sequential: "
+              << std::boolalpha << (sequentialGroups == parallelGroups) << std::endl;
+    pl::detail::FlatHashMap<int, int> table;
+    for (int key = 0; key < 20; ++key) {
+        try {
+            table.find_or_insert(key, [key]{
+                if (key % 7 == 3) {
+                    throw std::runtime_error("cannot make value");
+                }
+                return key * 10;
+            });
+        } catch (const std::runtime_error&) {
+        }
+    }
+    bool tableIntact = table.size() == 17;
+    for (int key = 0; key < 20; ++key) {
+        int* value = table.find(key);
+        tableIntact = tableIntact && (key % 7 == 3 ? value == nullptr : value && *value == key * 10);
+    }
+    std::cout << "Failed insertions leave the table intact: " << tableIntact << std::endl;
+
+    std::cout << "\n=== Test 21: Sort and top-k ===" << std::endl;
+    auto sortPipeline = std::list<int>{5, 3, 9, 1, 7} | pl::sort() | printAll("Sorted");
+    sortPipeline();
+    auto descPipeline = series | pl::sort(std::greater<>()) | printAll("Sorted descending");
+    descPipeline();
+    auto topPipeline = numbers | pl::top_k(5, std::greater<>()) | printAll("Top 5");
+    topPipeline();
+    auto bottomPipeline = words | pl::top_k(3) | printAll("First 3 words");
+    bottomPipeline();
+    (numbers | pl::sort(std::less<>(), 4)
+             | [&](auto sorted){
+                   std::cout << "Parallel sort ordered: " << std::boolalpha
+                             << std::is_sorted(sorted.begin(), sorted.end())
+                             << ", size " << sorted.size() << std::endl;
+               })();
+    size_t numbersBytes = numbers.size() * sizeof(int);
+    (numbers | pl::sort(std::less<>(), 1, numbersBytes)
+             | [](auto sorted){ std::cout << "Sort within memory budget: " << sorted.size() << " items" << std::endl; })();
+    try {
+        (numbers | pl::sort(std::less<>(), 4, numbersBytes) | [](auto){})();
+    } catch (const std::length_error& e) {
+        std::cout << e.what() << std::endl;
+    }
+
+    std::cout << "\n=== Test 22: Cancellation, deadline and budget ===" << std::endl;
+    std::vector<double> samples(2000000, 1.0);
+    auto slowStep = [](double x){
+        for (int i = 0; i < 200; ++i) {
+            x = x * 1.0000001 + 1e-9;
+        }
+        return x;
+    };
+    auto reportCancel = [](auto& cancellable, const pl::ExecutionLimits& limits) {
+        try {
+            cancellable.execute(limits);
+            std::cout << "Not cancelled" << std::endl;
+            return false;
+        } catch (const pl::PipelineCancelledError& e) {
+            std::cout << e.what() << std::endl;
+            return true;
+        }
+    };
+
+    auto cancellable = samples | pl::map(slowStep) | pl::filter([](double x){ return x > 0; })
+                     | [](auto v){ std::cout << "Processed " << v.size() << std::endl; };
+    pl::ExecutionLimits cancelLimits;
+    std::chrono::steady_clock::time_point cancelledAt;
+    std::thread canceller([&]{
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        cancelledAt = std::chrono::steady_clock::now();
+        cancelLimits.token.cancel();
+    });
+    bool wasCancelled = reportCancel(cancellable, cancelLimits);
+    auto idleAt = std::chrono::steady_clock::now();
+    canceller.join();
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(idleAt - cancelledAt).count();
+    std::cout << "Cancel-to-idle latency below 100 ms: " << std::boolalpha
+              << (wasCancelled && latency >= 0 && latency < 100000) << std::endl;
+
+    pl::ExecutionLimits deadlineLimits;
+    deadlineLimits.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(5);
+    reportCancel(cancellable, deadlineLimits);
+
+    pl::ExecutionLimits budgetLimits;
+    budgetLimits.item_budget = 10000;
+    auto budgeted = numbers | pl::sort(std::less<>(), 4) | pl::top_k(3);
+    reportCancel(budgeted, budgetLimits);
+    // k не кратно размеру блока top_k: проверки всё равно должны срабатывать
+    pl::ExecutionLimits topKLimits;
+    topKLimits.item_budget = 1000;
+    auto topKBudgeted = std::vector<int>(1000000) | pl::top_k(5, std::greater<>())
+                      | [](auto v){ std::cout << "Top-k ignored the budget: " << v.size() << " items" << std::endl; };
+    reportCancel(topKBudgeted, topKLimits);
+
+    auto small = std::vector<int>{1, 2, 3} | pl::map([](int x){ return x * 2; })
+               | [](auto v){ std::cout << "Small pipeline within budget: " << v.size() << " items" << std::endl; };
+    reportCancel(small, budgetLimits);
+
+    std::cout << "\n=== Test 23: Runtime-configured pipeline ===" << std::endl;
+    pl::KernelRegistry registry;
+    registry.add_map<int>("times3", [](int x){ return x * 3; });
+    registry.add_map<int>("plus7", [](int x){ return x + 7; });
+    registry.add_map<int>("half", [](int x){ return x / 2; });
+    registry.add_map<int>("square", [](int x){ return x * x; });
+    registry.add_map<int>("to_double", [](int x){ return static_cast<double>(x); });
+    registry.add_filter<int>("odd", [](int x){ return x % 2 != 0; });
+    auto configured = pl::RuntimePipeline::parse(registry, "times3 | plus7 | half | square");
+    auto runtimePipeline = std::vector<int>{2, 3, 4}
+                         | configured.stage<int, int>()
+                         | printAll("Configured multi-transform");
+    runtimePipeline();
+    std::vector<int> handWritten, fromConfig;
+    (numbers | pl::map([](int x){ return (x * 3 + 7) / 2 * ((x * 3 + 7) / 2); }) | [&](auto v){ handWritten = v; })();
+    (numbers | configured.stage<int, int>() | [&](auto v){ fromConfig = v; })();
+    std::cout << "Configured matches hand-written: " << std::boolalpha << (handWritten == fromConfig) << std::endl;
+    auto filtered = pl::RuntimePipeline::parse(registry, "odd | times3").run<int, int>(std::vector<int>{1, 2, 3, 4, 5});
+    std::cout << "Odd times 3: " << filtered.size() << " items, last " << filtered.back() << std::endl;
+    std::vector<int> mixedInput, mixedExpected;
+    for (int x = 1; x <= 100; ++x) {
+        mixedInput.push_back(x);
+        if (x * 3 % 2 != 0) {
+            mixedExpected.push_back((x * 3 + 7) / 2);
+        }
+    }
+    auto mixed = pl::RuntimePipeline::parse(registry, "times3 | odd | plus7 | half").run<int, int>(mixedInput, 7);
+    std::cout << "Filter and in-place kernels across partial batches: " << (mixed == mixedExpected) << std::endl;
+    try {
+        pl::RuntimePipeline::parse(registry, "to_double | square");
+    } catch (const std::invalid_argument& e) {
+        std::cout << e.what() << std::endl;
+    }
+
+    std::cout << "\n=== Test 24: Adaptive filter order ===" << std::endl;
+    auto expensiveLoose = [](int x){
+        double acc = x;
+        for (int i = 0; i < 50; ++i) {
+            acc = acc * 0.5 + 1.0;
+        }
+        return acc > 0 && x % 10 != 0;
+    };
+    auto cheapSelective = [](int x){ return x % 10 == 1; };
+    auto adaptive = pl::commutative_filters(expensiveLoose, cheapSelective);
+    auto adaptivePipeline = numbers | adaptive
+                          | [](auto kept){ std::cout << "Kept " << kept.size() << " items" << std::endl; };
+    adaptivePipeline();
+    auto chosen = adaptive.order();
+    std::cout << "Cheap selective filter runs first: " << std::boolalpha << (chosen.front() == 1)
+              << " (reorders: " << adaptive.reorders() << ")" << std::endl;
+
+    std::cout << "\n=== Test 25: Shared pipeline across threads ===" << std::endl;
+    const auto shared = make_pipeline(std::vector<int>{})
+                      | pl::map([](int x){ return x * 3 + 7; })
+                      | pl::filter([](int x){ return x % 2 == 0; })
+                      | [](auto v){ long long total = 0; for (int x : v) total += x; return total; };
+    std::vector<long long> sharedResults(4);
+    std::vector<std::thread> requests;
+    for (int t = 0; t < 4; ++t) {
+        requests.emplace_back([&, t]{
+            std::vector<int> input(1000 * (t + 1));
+            for (size_t i = 0; i < input.size(); ++i) {
+                input[i] = static_cast<int>(i);
+            }
+            for (int repeat = 0; repeat < 50; ++repeat) {
+                sharedResults[t] = shared.run(input);
+            }
+        });
+    }
+    for (auto& r : requests) {
+        r.join();
+    }
+    std::cout << "Concurrent results:";
+    for (auto r : sharedResults) {
+        std::cout << " " << r;
+    }
+    std::cout << std::endl;
+    std::cout << "Default input: " << shared.run() << std::endl;
+
+    std::cout << "\n=== Test 26: Distinct and sketches ===" << std::endl;
+    auto distinctPipeline = std::vector<std::string>{"a", "b", "a", "c", "b", "d"}
+                          | pl::distinct() | printAll("Distinct");
+    distinctPipeline();
+    auto hllPipeline = numbers | pl::approx_distinct(12, 4)
+                     | [](double estimate){
+                           std::cout << "Approx distinct of 1000 values within 5%: " << std::boolalpha
+                                     << (std::abs(estimate - 1000) < 50) << std::endl;
+                       };
+    hllPipeline();
+    auto cmsPipeline = numbers | pl::approx_count(4096, 4, 4)
+                     | [](const auto& sketch){
+                           std::cout << "Approx count of 7: " << sketch.estimate(7)
+                                     << " (exact 200)" << std::endl;
+                       };
+    cmsPipeline();
+
+    std::cout << "\n=== Test 27: Random sampling ===" << std::endl;
+    std::vector<int> sampledOnce, sampledParallel;
+    (numbers | pl::sample(0.1, 42) | [&](auto v){ sampledOnce = v; })();
+    (numbers | pl::sample(0.1, 42, 4) | [&](auto v){ sampledParallel = v; })();
+    std::cout << "Sample of 10% is near 20000: " << std::boolalpha
+              << (sampledOnce.size() > 19000 && sampledOnce.size() < 21000)
+              << ", reproducible in parallel: " << (sampledOnce == sampledParallel) << std::endl;
+    auto maskPipeline = numbers | pl::bernoulli_mask(0.25, 7, 4)
+                      | [](auto mask){
+                            size_t ones = 0;
+                            for (auto bit : mask) {
+                                ones += bit;
+                            }
+                            std::cout << "Mask length " << mask.size() << ", selected near 25%: " << std::boolalpha
+                                      << (ones > 48000 && ones < 52000) << std::endl;
+                        };
+    maskPipeline();
+    auto reservoirPipeline = numbers | pl::reservoir(5, 3)
+                           | [](auto picked){ std::cout << "Reservoir size: " << picked.size() << std::endl; };
+    reservoirPipeline();
+    auto rngPipeline = numbers | pl::sample(0.5, pl::simple_rng_streams(0.5, 7.0, 10.0, 11))
+                     | [](auto picked){ std::cout << "SimpleRNG-driven sample is non-empty: " << std::boolalpha << !picked.empty() << std::endl; };
+    rngPipeline();
+
+    std::cout << "\n=== Test 28: Join ===" << std::endl;
+    struct Order { int customer; int amount; };
+    std::vector<std::pair<int, std::string>> customers = {{3, "Carol"}, {1, "Alice"}, {2, "Bob"}};
+    std::vector<Order> orders = {{1, 10}, {3, 5}, {1, 7}, {4, 1}};
+    auto joinPipeline = orders
+                      | pl::join(make_pipeline(customers), [](const Order& o){ return o.customer; },
+                                 [](const auto& c){ return c.first; })
+                      | [](auto rows){
+                            for (const auto& [order, customer] : rows) {
+                                std::cout << customer.second << " ordered " << order.amount << std::endl;
+                            }
+                        };
+    joinPipeline();
+    std::vector<int> left = {1, 2, 2, 3, 5}, right = {2, 2, 3, 4, 5, 5};
+    auto identity = [](int x){ return x; };
+    std::vector<std::pair<int, int>> merged, hashed;
+    (left | pl::join(make_pipeline(right), identity, identity, pl::JoinStrategy::Merge) | [&](auto v){ merged = v; })();
+    (left | pl::join(make_pipeline(right), identity, identity, pl::JoinStrategy::Hash) | [&](auto v){ hashed = v; })();
+    std::cout << "Merge join rows: " << merged.size() << ", matches hash join: " << std::boolalpha << (merged == hashed) << std::endl;
+
+    std::cout << "\n=== Test 29: Expression stages ===" << std::endl;
+    {
+        using namespace pl::placeholders;
+        static_assert(std::is_same_v<decltype(pl::fold_for<unsigned>(pl::then(_1 * 2u, _1 * 3u))), decltype(_1 * 6u)>);
+        static_assert(std::is_same_v<decltype(pl::fold_for<unsigned>(pl::then(_1 + 1u, _1 * 3u + 7u))), decltype(_1 * 3u + 10u)>);
+        static_assert(!std::is_same_v<decltype(pl::fold_for<int>(pl::then(_1 * 2, _1 * 3))), decltype(_1 * 6)>);
+        static_assert(!std::is_same_v<decltype(pl::fold_for<unsigned long long>(pl::then(_1 * 2u, _1 * 3u))), decltype(_1 * 6u)>);
+        static_assert((_1 * 3 + 7)(2) == 13);
+
+        auto exprPipeline = 2 | (_1 * 3) | (_1 + 7) | (_1 / 2) | (_1 * _1)
+                          | [](auto x){std::cout << "Expression multi-transform: " << x << std::endl;};
+        exprPipeline();
+
+        auto wideResult = (1LL | (_1 * 100000) | (_1 * 100000)).materialize().run();
+        auto roundedResult = (9007199254740992.0 | (_1 + 1) | (_1 + 1)).materialize().run();
+        std::cout << "Long long input: " << wideResult << ", double input unchanged: " << std::boolalpha
+                  << (roundedResult == 9007199254740992.0) << std::endl;
+
+        auto foldedPipeline = numbers | pl::each(_1 * 2) | pl::each(_1 * 3 + 7) | pl::top_k(1, std::greater<>())
+                            | printAll("Largest of x * 6 + 7");
+        foldedPipeline();
+    }
+
+    std::cout << "\n=== Test 30: Compile-time pipelines ===" << std::endl;
+    {
+        using namespace pl::placeholders;
+        constexpr auto squareAtCompileTime = pl::constant(5)
+                                           | [](auto x){return x + 10;}
+                                           | [](auto x){return x * x;};
+        static_assert(squareAtCompileTime.value() == 225);
+        constexpr auto sizeAtCompileTime = pl::constant(std::array<char, 6>{'a', 'b', 'c', 'd', 'e', 'f'})
+                                         | pipeline_size
+                                         | ((_1 - 1) * 10);
+        static_assert(sizeAtCompileTime.value() == 50);
+        constexpr auto squares = pl::table<8>([](size_t i){ return (pl::constant(i) | (_1 * _1 + 1)).value(); });
+        static_assert(squares[7] == 50);
+        squareAtCompileTime | [](auto x){std::cout << "Compile-time square: " << x << std::endl;};
+        std::cout << "Compile-time table:";
+        for (auto v : squares) {
+            std::cout << " " << v;
+        }
+        std::cout << std::endl;
+    }
+
+    std::cout << "\n=== Test 31: Batched scheduler ===" << std::endl;
+    {
+        pl::SchedulerMetrics schedulerMetrics;
+        std::vector<std::future<int>> scaled;
+        std::vector<std::future<size_t>> lengths;
+        {
+            pl::Scheduler scheduler(2);
+            auto scale = scheduler.add_shape<int>(make_pipeline(0) | [](int x){ return x * 3; } | [](int x){ return x + 7; });
+            auto length = scheduler.add_shape<std::string>(make_pipeline(std::string{}) | pipeline_size);
+            std::vector<std::thread> clients;
+            std::mutex futuresMutex;
+            for (int t = 0; t < 4; ++t) {
+                clients.emplace_back([&, t]{
+                    for (int i = 0; i < 2500; ++i) {
+                        auto a = scheduler.submit(scale, t * 2500 + i);
+                        auto b = scheduler.submit(length, std::string(static_cast<size_t>(i % 10), 'x'));
+                        std::lock_guard lock(futuresMutex);
+                        scaled.push_back(std::move(a));
+                        lengths.push_back(std::move(b));
+                    }
+                });
+            }
+            for (auto& c : clients) {
+                c.join();
+            }
+            schedulerMetrics = scheduler.metrics();
+        }
+        long long scaledTotal = 0;
+        size_t lengthTotal = 0;
+        for (auto& f : scaled) {
+            scaledTotal += f.get();
+        }
+        for (auto& f : lengths) {
+            lengthTotal += f.get();
+        }
+        std::cout << "Scaled total: " << scaledTotal << ", length total: " << lengthTotal << std::endl;
+        std::vector<int> order;
+        {
+            std::mutex orderMutex;
+            pl::Scheduler fifo(1, 4);
+            auto record = fifo.add_shape<int>(make_pipeline(0) | [&](int x){ std::lock_guard lock(orderMutex); order.push_back(x); });
+            std::vector<std::future<void>> done;
+            for (int i = 0; i < 200; ++i) {
+                done.push_back(fifo.submit(record, i));
+            }
+            for (auto& f : done) {
+                f.get();
+            }
+        }
+        std::cout << "Oldest requests served first: " << std::boolalpha << std::is_sorted(order.begin(), order.end()) << std::endl;
+        {
+            // Запрос 0 держит единственный поток, пока 1..8 не соберутся в одну пачку;
+            // запрос 5 бросает посреди неё
+            std::promise<void> release;
+            std::shared_future<void> released = release.get_future().share();
+            pl::Scheduler partial(1, 8);
+            auto risky = partial.add_shape<int>(make_pipeline(0) | [released](int x){
+                if (x == 0) {
+                    released.wait();
+                }
+                if (x == 5) {
+                    throw std::runtime_error("bad request");
+                }
+                return x * 2;
+            });
+            std::vector<std::future<int>> results;
+            for (int i = 0; i <= 8; ++i) {
+                results.push_back(partial.submit(risky, i));
+            }
+            release.set_value();
+            bool othersServed = true;
+            bool failureReported = false;
+            for (int i = 0; i <= 8; ++i) {
+                try {
+                    int value = results[static_cast<size_t>(i)].get();
+                    othersServed = othersServed && i != 5 && value == i * 2;
+                } catch (const std::runtime_error&) {
+                    failureReported = i == 5;
+                }
+            }
+            std::cout << "Failure mid-batch reaches only its request: " << (othersServed && failureReported) << std::endl;
+        }
+        std::cout << "Submitted: " << schedulerMetrics.submitted
+                  << ", fewer batches than submissions: " << std::boolalpha
+                  << (schedulerMetrics.batches < schedulerMetrics.submitted) << std::endl;
+    }
+
+    std::cout << "\n=== Test 32: Text stages ===" << std::endl;
+    {
+        static_assert(!std::is_invocable_v<decltype(pl::lines), std::string>);
+        const std::string text = "12 7 -3\n4\t5\r\n6\n";
+        auto linesPipeline = std::string_view(text) | pl::lines
+                           | [](auto v){ std::cout << "Lines: " << v.size() << ", second: \"" << v[1] << "\"" << std::endl; };
+        linesPipeline();
+        std::vector<std::string_view> tokens;
+        (std::string_view(text) | pl::tokenize() | [&](auto v){ tokens = v; })();
+        std::cout << "Tokens point into source: " << std::boolalpha << (tokens.front().data() == text.data()) << std::endl;
+        auto sumPipeline = std::string_view(text) | pl::tokenize() | pl::parse_int()
+                         | [](auto v){ long long total = 0; for (int x : v) total += x; return total; }
+                         | [](auto total){ std::cout << "Sum of integers: " << total << std::endl; };
+        sumPipeline();
+        const std::string csv = "1.5,2.25,,4";
+        auto csvPipeline = std::string_view(csv) | pl::split(',')
+                         | pl::filter([](std::string_view field){ return !field.empty(); })
+                         | pl::parse_double()
+                         | [](auto v){ double total = 0; for (double x : v) total += x; std::cout << "Sum of fields: " << total << std::endl; };
+        csvPipeline();
+        const std::string record = "a::b::::c";
+        auto fields = pl::split("::")(record.c_str());
+        std::cout << "Fields: " << fields.size() << std::endl;
+        auto emptyFields = pl::split(',')(std::string_view());
+        auto trailingFields = pl::split(',')(std::string_view("a,"));
+        std::cout << "Empty input gives one empty field: " << (emptyFields.size() == 1 && emptyFields[0].empty())
+                  << ", trailing delimiter: " << trailingFields.size() << " fields" << std::endl;
+        try {
+            pl::parse_int()(std::vector<std::string_view>{"12x"});
+        } catch (const std::invalid_argument& e) {
+            std::cout << e.what() << std::endl;
+        }
+    }
+
+    std::cout << "\n=== Test 33: Columnar files ===" << std::endl;
+    {
+        const std::string columnarPath = (std::filesystem::temp_directory_path() / "pipeline_test.col").string();
+        std::vector<std::tuple<int, double, uint8_t>> rows;
+        for (int i = 0; i < 1000; ++i) {
+            rows.emplace_back(i, i * 0.5, static_cast<uint8_t>(i % 7));
+        }
+        auto writePipeline = rows | pl::write_columnar(columnarPath)
+                           | [](auto v){ std::cout << "Written rows: " << v.size() << std::endl; };
+        writePipeline();
+        auto readPipeline = columnarPath | pl::read_columnar()
+                          | [](const pl::ColumnarFile& file){
+                                double total = 0;
+                                for (double x : file.column<double>(1)) {
+                                    total += x;
+                                }
+                                std::cout << "Columns: " << file.columns() << ", rows: " << file.rows()
+                                          << ", sum of column 1: " << total << std::endl;
+                                std::cout << "Column 0 is 64-byte aligned: " << std::boolalpha
+                                          << (reinterpret_cast<uintptr_t>(file.column<int>(0).data()) % 64 == 0) << std::endl;
+                            };
+        readPipeline();
+        auto reloaded = pl::ColumnarFile(columnarPath).records<int, double, uint8_t>();
+        std::cout << "Round trip matches: " << std::boolalpha << (reloaded == rows) << std::endl;
+        try {
+            pl::ColumnarFile(columnarPath).column<float>(1);
+        } catch (const std::invalid_argument& e) {
+            std::cout << e.what() << std::endl;
+        }
+
+        const auto rowCount = make_pipeline(0) | pl::read_columnar(columnarPath)
+                            | [](const pl::ColumnarFile& file){ return file.rows(); };
+        size_t rowsBefore = rowCount.run();
+        (std::vector<int>(10, 1) | pl::write_columnar(columnarPath) | [](auto){})();
+        std::cout << "Re-run sees the replaced file: " << (rowsBefore == 1000 && rowCount.run() == 10) << std::endl;
+
+        const auto writer = make_pipeline(rows) | pl::write_columnar(columnarPath) | [](auto v){ return v.size(); };
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; ++t) {
+            writers.emplace_back([&]{
+                for (int repeat = 0; repeat < 10; ++repeat) {
+                    writer.run();
+                }
+            });
+        }
+        for (auto& w : writers) {
+            w.join();
+        }
+        std::cout << "Concurrent writers leave a complete file: "
+                  << (pl::ColumnarFile(columnarPath).records<int, double, uint8_t>() == rows) << std::endl;
+        mode_t savedMask = umask(027);
+        (std::vector<int>(3, 1) | pl::write_columnar(columnarPath) | [](auto){})();
+        umask(savedMask);
+        auto permissions = std::filesystem::status(columnarPath).permissions();
+        std::cout << "Written file respects umask: "
+                  << (permissions == (std::filesystem::perms::owner_read | std::filesystem::perms::owner_write
+                                      | std::filesystem::perms::group_read)) << std::endl;
+        std::filesystem::remove(columnarPath);
+    }
+
+    std::cout << "\n=== Test 34: Buffer recycling ===" << std::endl;
+    {
+        const auto recycling = make_pipeline(std::vector<int>{})
+                             | pl::map([](int x){ return x * 3 + 7; })
+                             | pl::filter([](int x){ return x % 2 == 0; })
+                             | pl::map([](int x){ return x / 2; })
+                             | [](const std::vector<int>& v){ long long total = 0; for (int x : v) total += x; return total; };
+        long long expected = recycling.run(numbers);
+        for (int warmup = 0; warmup < 3; ++warmup) {
+            recycling.run(numbers);
+        }
+        // Буфер, выросший внутри шага (reserve, push_back, копирование),
+        // вернулся бы в пул с большей ёмкостью, поэтому после разогрева
+        // каждый запуск должен возвращать ровно столько же байт
+        auto warm = recycling.buffer_stats();
+        recycling.run(numbers);
+        auto before = recycling.buffer_stats();
+        size_t bytesPerRun = before.returned_bytes - warm.returned_bytes;
+#ifdef PIPELINE_COUNT_ALLOCATIONS
+        size_t allocationsBefore = allocationCount.load();
+#endif
+        bool same = true;
+        for (int repeat = 0; repeat < 100; ++repeat) {
+            same = same && recycling.run(numbers) == expected;
+        }
+#ifdef PIPELINE_COUNT_ALLOCATIONS
+        size_t allocations = allocationCount.load() - allocationsBefore;
+#endif
+        auto after = recycling.buffer_stats();
+        std::cout << "Results stable: " << std::boolalpha << same
+                  << ", new buffers in 100 steady-state runs: " << after.misses - before.misses
+                  << ", reused buffers: " << after.hits - before.hits << std::endl;
+        std::cout << "Buffer capacities unchanged after warm-up: "
+                  << (bytesPerRun > 0 && after.returned_bytes - before.returned_bytes == 100 * bytesPerRun) << std::endl;
+#ifdef PIPELINE_COUNT_ALLOCATIONS
+        std::cout << "Heap allocations in 100 steady-state runs: " << allocations << std::endl;
+#endif
+    }
+
+    std::cout << "\n=== Test 35: Incremental recomputation ===" << std::endl;
+    {
+        std::vector<int> growing = {1, 2, 3, 4, 5};
+        size_t mapCalls = 0;
+        auto evenSquares = pl::incremental(growing)
+                         | pl::map([&](int x){ ++mapCalls; return x * x; })
+                         | pl::filter([](int x){ return x % 2 == 0; })
+                         | pl::reduce(0LL)
+                         | [](long long total){ return total * 2; };
+        auto sizeTwice = pl::incremental(growing) | pipeline_size | [](auto x){ return x * 2; };
+        std::cout << "Initial: " << evenSquares.run() << ", size twice: " << sizeTwice.run() << std::endl;
+        for (int i = 6; i <= 1000; ++i) {
+            growing.push_back(i);
+        }
+        size_t callsBefore = mapCalls;
+        long long incrementalTotal = evenSquares.run();
+        long long fullTotal = (growing | pl::map([](int x){ return x * x; }) | pl::filter([](int x){ return x % 2 == 0; })
+                                       | pl::reduce(0LL) | [](long long total){ return total * 2; }).run();
+        std::cout << "After append: " << incrementalTotal << ", matches full run: " << std::boolalpha
+                  << (incrementalTotal == fullTotal) << ", new map calls: " << mapCalls - callsBefore
+                  << ", size twice: " << sizeTwice.run() << std::endl;
+        auto kept = pl::incremental(growing) | pl::filter([](int x){ return x % 100 == 0; });
+        kept.run();
+        growing.resize(450);
+        std::cout << "After shrink, kept: " << kept.run().size() << std::endl;
+    }
+
+    std::cout << "\n=== Test 36: NUMA-aware parallel stages ===" << std::endl;
+    {
+        const auto& topology = pl::NumaTopology::system();
+        bool currentCpuListed = !std::filesystem::exists("/sys/devices/system/node/node0");
+        for (size_t node = 0; node < topology.nodes(); ++node) {
+            const auto& cpus = topology.cpus(node);
+            currentCpuListed = currentCpuListed || std::find(cpus.begin(), cpus.end(), sched_getcpu()) != cpus.end();
+        }
+        std::cout << "Current CPU is listed in the NUMA topology: " << std::boolalpha << currentCpuListed << std::endl;
+        auto groupSums = [&]{
+            std::vector<std::pair<int, long long>> result;
+            (numbers | pl::group_by([](int x){ return x % 10; }, pl::sum([](int x){ return static_cast<long long>(x); }), 4)
+                     | pl::sort([](const auto& a, const auto& b){ return a.first < b.first; }, 4)
+                     | [&](auto v){ result = v; })();
+            return result;
+        };
+        auto pinned = groupSums();
+        pl::set_numa_aware(false);
+        auto unpinned = groupSums();
+        pl::set_numa_aware(true);
+        std::cout << "Same result with and without pinning: " << (pinned == unpinned) << std::endl;
+
+        // Вход на двух узлах: [0, 1000) и [1000, 4000); части не пересекают границу
+        auto plan = pl::detail::plan_chunks(4000, 4, {{0, 1000, 0}, {1000, 4000, 1}});
+        bool split = plan.bounds == std::vector<size_t>{0, 1000, 2000, 3000, 4000}
+                  && plan.nodes == std::vector<int>{0, 1, 1, 1};
+        // Страницы чередуются чаще, чем есть частей: деление поровну, узел по началу части
+        auto interleaved = pl::detail::plan_chunks(90, 3, {{0, 10, 0}, {10, 20, 1}, {20, 30, 0}, {30, 90, 1}});
+        split = split && interleaved.bounds == std::vector<size_t>{0, 30, 60, 90}
+                      && interleaved.nodes == std::vector<int>{0, 1, 1};
+        std::cout << "Chunks split at node boundaries: " << split << std::endl;
+
+        std::vector<int> big(1 << 20);
+        for (size_t i = 0; i < big.size(); ++i) {
+            big[i] = static_cast<int>((i * 2654435761u) % 1000003);
+        }
+        auto ranges = pl::detail::node_ranges(big.size(), pl::detail::placement_of(big));
+        bool covered = ranges.front().begin == 0 && ranges.back().end == big.size();
+        for (size_t r = 1; r < ranges.size(); ++r) {
+            covered = covered && ranges[r].begin == ranges[r - 1].end && ranges[r].node != ranges[r - 1].node;
+        }
+        std::cout << "Node ranges cover the input: " << covered << std::endl;
+        auto expectedSorted = big;
+        std::sort(expectedSorted.begin(), expectedSorted.end());
+        auto parallelSort = [&]{
+            std::vector<int> result;
+            (big | pl::sort(std::less<>(), 4) | [&](auto v){ result = v; })();
+            return result;
+        };
+        auto sortedPinned = parallelSort();
+        pl::set_numa_aware(false);
+        auto sortedUnpinned = parallelSort();
+        pl::set_numa_aware(true);
+        std::cout << "Parallel sort of 2^20 items, pinned and unpinned: "
+                  << (sortedPinned == expectedSorted && sortedUnpinned == expectedSorted) << std::endl;
+    }
+
     std::cout << "\n=== All tests completed! ===" << std::endl;
     std::cin.get();
     return 0;
@@ -4,6 +4,7 @@
 #include <iterator>
 #include <cmath>
 #include <stdexcept>
+#include <cstddef>
 
 class EndSentinel {
 public:
@@ -42,6 +43,23 @@ public:
         m_current_x = m_initial_x;
     }
 
+    // Следующее значение последовательности, приведённое к [0, 1)
+    double uniform() {
+        return next() / m_m;
+    }
+
+    // Пакетная генерация n значений в [0, 1): состояние держится в локальных
+    // переменных, а не перечитывается из объекта на каждом шаге
+    void generate(double* out, size_t n) {
+        double x = m_current_x;
+        const double a = m_a, c = m_c, m = m_m, inv_m = 1.0 / m_m;
+        for (size_t i = 0; i < n; ++i) {
+            x = std::fmod(a * x + c, m);
+            out[i] = x * inv_m;
+        }
+        m_current_x = x;
+    }
+
     class Iterator {
     private:
         SimpleRNG* rng;